@@ -0,0 +1,115 @@
+//
+// Debug heap allocation counter.
+//
+// Debug builds replace the global operator new, over-aligned forms included,
+// so every allocation bumps a per-thread counter; the frame loop reads it on
+// the main thread to prove a steady-state frame never touches the heap.
+// Release builds (NDEBUG) keep the standard allocator and count() stays at
+// zero.  Exactly one translation
+// unit defines A3_ALLOCATION_COUNTER_IMPLEMENTATION before including this.
+//
+
+#ifndef A3_ALLOCATIONCOUNTER_H
+#define A3_ALLOCATIONCOUNTER_H
+
+#include <cstdint>
+
+namespace AllocationCounter {
+#ifndef NDEBUG
+    constexpr bool ENABLED = true;
+#else
+    constexpr bool ENABLED = false;
+#endif
+
+    // constant initialized, so safe to touch from inside operator new
+    inline uint64_t &threadCount() {
+        static thread_local uint64_t count = 0;
+        return count;
+    }
+
+    // heap allocations made by the calling thread so far
+    inline uint64_t count() { return threadCount(); }
+}
+
+#if defined(A3_ALLOCATION_COUNTER_IMPLEMENTATION) && !defined(NDEBUG)
+
+#include <cstdlib>
+#include <new>
+
+namespace AllocationCounter {
+    // aligned_alloc wants a size that is a multiple of the alignment, and
+    //  MSVC's CRT only has its own pair
+    inline void *alignedAllocate(std::size_t size, std::align_val_t alignment) {
+        const std::size_t align = (std::size_t) alignment;
+        const std::size_t rounded = ((size ? size : 1) + align - 1) & ~(align - 1);
+#ifdef _WIN32
+        return _aligned_malloc(rounded, align);
+#else
+        return std::aligned_alloc(align, rounded);
+#endif
+    }
+
+    inline void alignedFree(void *memory) {
+#ifdef _WIN32
+        _aligned_free(memory);
+#else
+        std::free(memory);
+#endif
+    }
+}
+
+void *operator new(std::size_t size) {
+    AllocationCounter::threadCount()++;
+    void *memory = std::malloc(size ? size : 1);
+    if (!memory) throw std::bad_alloc();
+    return memory;
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    AllocationCounter::threadCount()++;
+    return std::malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept { return operator new(size, tag); }
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete[](void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+void operator delete[](void *memory, std::size_t) noexcept { std::free(memory); }
+void operator delete(void *memory, const std::nothrow_t &) noexcept { std::free(memory); }
+void operator delete[](void *memory, const std::nothrow_t &) noexcept { std::free(memory); }
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    AllocationCounter::threadCount()++;
+    void *memory = AllocationCounter::alignedAllocate(size, alignment);
+    if (!memory) throw std::bad_alloc();
+    return memory;
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    AllocationCounter::threadCount()++;
+    return AllocationCounter::alignedAllocate(size, alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &tag) noexcept {
+    return operator new(size, alignment, tag);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept { AllocationCounter::alignedFree(memory); }
+void operator delete[](void *memory, std::align_val_t) noexcept { AllocationCounter::alignedFree(memory); }
+void operator delete(void *memory, std::size_t, std::align_val_t) noexcept { AllocationCounter::alignedFree(memory); }
+void operator delete[](void *memory, std::size_t, std::align_val_t) noexcept { AllocationCounter::alignedFree(memory); }
+void operator delete(void *memory, std::align_val_t, const std::nothrow_t &) noexcept {
+    AllocationCounter::alignedFree(memory);
+}
+void operator delete[](void *memory, std::align_val_t, const std::nothrow_t &) noexcept {
+    AllocationCounter::alignedFree(memory);
+}
+
+#endif
+
+#endif //A3_ALLOCATIONCOUNTER_H
@@ -0,0 +1,186 @@
+//
+// Allocators that keep the frame loop off the heap.
+//
+// FrameArena is a bump allocator reset at the start of every frame; anything
+// only needed until the end of the function that fills it (light bins,
+// upload lists) comes from it, via FrameArray for the common case of a
+// bounded list.  Nothing kept in a member may point into it, since the next
+// reset() reclaims the memory; those lists reserve their own storage once
+// instead.  ObjectPool holds long-lived objects (the loaders' textures and
+// meshes, the capture buffers) built once up front and lent out and
+// returned without ever touching the heap again.
+//
+
+#ifndef A3_ALLOCATORS_H
+#define A3_ALLOCATORS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+class FrameArena {
+public:
+    void init(size_t bytes) {
+        _block.reset(new unsigned char[bytes]);
+        _capacity = bytes;
+        _used = 0;
+    }
+
+    // reset() /////////////////////////////////////////////////////////////////
+    //
+    //  Releases everything handed out since the last reset.  Call once at the
+    //      start of a frame.  If last frame overflowed into extra blocks the
+    //      arena is grown to fit it, so the heap is only hit until the arena
+    //      has seen the largest frame.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void reset() {
+        if (!_overflow.empty()) {
+            const size_t needed = _capacity + _overflowBytes;
+            fprintf(stdout, "[INFO]: frame arena grown from %zu to %zu KB\n", _capacity / 1024, needed * 2 / 1024);
+            _overflow.clear();
+            _overflowBytes = 0;
+            init(needed * 2);
+        }
+        _used = 0;
+    }
+
+    // allocate() //////////////////////////////////////////////////////////////
+    //
+    //  Uninitialized, aligned memory valid until the next reset().
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void *allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        const size_t start = (_used + alignment - 1) & ~(alignment - 1);
+        if (start + bytes <= _capacity) {
+            _used = start + bytes;
+            if (_used > _highWater) _highWater = _used;
+            return _block.get() + start;
+        }
+
+        // too small this frame: take a block of its own and remember to grow
+        _overflow.emplace_back(new unsigned char[bytes + alignment]);
+        _overflowBytes += bytes + alignment;
+        const uintptr_t address = (uintptr_t) _overflow.back().get();
+        return (void *) ((address + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    }
+
+    // only for types that need no destructor, since reset() runs none
+    template<typename T>
+    T *allocateArray(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "the arena never runs destructors");
+        return static_cast<T *>(allocate(count * sizeof(T) + (count == 0), alignof(T)));
+    }
+
+    size_t capacity() const { return _capacity; }
+    size_t highWater() const { return _highWater; }
+
+private:
+    std::unique_ptr<unsigned char[]> _block;
+    size_t _capacity = 0;
+    size_t _used = 0;
+    size_t _highWater = 0;
+
+    std::vector<std::unique_ptr<unsigned char[]>> _overflow;
+    size_t _overflowBytes = 0;
+};
+
+// the arena for the current frame, reset by the frame loop
+inline FrameArena &frameArena() {
+    static FrameArena arena;
+    return arena;
+}
+
+// FrameArray //////////////////////////////////////////////////////////////////
+//
+//  A list with a fixed capacity whose storage comes from a FrameArena, so it
+//      must not outlive the frame it was made in.  push_back() past the
+//      capacity is ignored and reported by full().
+//
+////////////////////////////////////////////////////////////////////////////////
+template<typename T>
+class FrameArray {
+public:
+    FrameArray() = default;
+    FrameArray(FrameArena &arena, size_t capacity)
+            : _data(arena.allocateArray<T>(capacity)), _capacity(capacity) {}
+
+    void push_back(const T &value) {
+        if (_size < _capacity) _data[_size++] = value;
+    }
+
+    // count default-initialized (for arithmetic types, zeroed) elements
+    void assign(size_t count, const T &value) {
+        _size = count < _capacity ? count : _capacity;
+        for (size_t i = 0; i < _size; i++) _data[i] = value;
+    }
+
+    void clear() { _size = 0; }
+    bool empty() const { return _size == 0; }
+    bool full() const { return _size == _capacity; }
+    size_t size() const { return _size; }
+
+    T *data() { return _data; }
+    const T *data() const { return _data; }
+    T &operator[](size_t index) { return _data[index]; }
+    const T &operator[](size_t index) const { return _data[index]; }
+    T *begin() { return _data; }
+    T *end() { return _data + _size; }
+    const T *begin() const { return _data; }
+    const T *end() const { return _data + _size; }
+
+private:
+    T *_data = nullptr;
+    size_t _capacity = 0;
+    size_t _size = 0;
+};
+
+// ObjectPool //////////////////////////////////////////////////////////////////
+//
+//  count objects constructed once by init() and lent out by acquire() until
+//      they are release()d.  Neither call allocates; acquire() returns
+//      nullptr when every object is out.  Not thread safe on its own.
+//
+////////////////////////////////////////////////////////////////////////////////
+template<typename T>
+class ObjectPool {
+public:
+    template<typename... Args>
+    void init(size_t count, const Args &... args) {
+        _objects.clear();
+        _free.clear();
+        _objects.reserve(count);
+        _free.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            _objects.emplace_back(new T(args...));
+            _free.push_back(_objects.back().get());
+        }
+    }
+
+    void clear() {
+        _free.clear();
+        _objects.clear();
+    }
+
+    T *acquire() {
+        if (_free.empty()) return nullptr;
+        T *object = _free.back();
+        _free.pop_back();
+        return object;
+    }
+
+    // the free list was reserved for every object, so this never reallocates
+    void release(T *object) { _free.push_back(object); }
+
+    size_t available() const { return _free.size(); }
+
+private:
+    std::vector<std::unique_ptr<T>> _objects;
+    std::vector<T *> _free;
+};
+
+#endif //A3_ALLOCATORS_H
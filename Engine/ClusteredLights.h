@@ -0,0 +1,313 @@
+//
+// Clustered forward lighting.
+//
+// Each view's frustum is cut into a grid of clusters: CLUSTERS_X x CLUSTERS_Y
+// screen tiles and CLUSTERS_Z exponentially spaced depth slices.  Once per
+// frame the CPU bins every point light into the clusters its bounding sphere
+// touches and uploads three texture buffers: the lights, a flat list of
+// light indices, and each cluster's (offset, count) into that list.  Shaders
+// include GLSL_SOURCE and call clusteredLighting(), which only loops over
+// the handful of lights in the fragment's own cluster.
+//
+
+#ifndef A3_CLUSTEREDLIGHTS_H
+#define A3_CLUSTEREDLIGHTS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Allocators.h"
+#include "MultiView.h"
+
+class ClusteredLights {
+public:
+    static const int CLUSTERS_X = 16;
+    static const int CLUSTERS_Y = 9;
+    static const int CLUSTERS_Z = 24;
+    static const int CLUSTERS_PER_VIEW = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+    static const int MAX_LIGHT_INDICES = 1 << 20;
+
+    struct PointLight {
+        glm::vec3 position;
+        float radius;                    // no contribution beyond this distance
+        glm::vec3 color;
+        float padding;
+    };
+
+    // uniform and sampler locations of one program that uses GLSL_SOURCE
+    struct Locations {
+        GLint lightData, ranges, indices;
+        GLint viewMatrices, viewports, gridSize, depthScaleBias;
+    };
+
+    // texture units the light buffers are bound to; programs must leave them free
+    static const GLint LIGHT_DATA_UNIT = 5;
+    static const GLint RANGES_UNIT = 6;
+    static const GLint INDICES_UNIT = 7;
+
+    // the GLSL every lit fragment shader includes after its #version line
+    static constexpr const char *GLSL_SOURCE = R"(
+uniform samplerBuffer clusterLightData;     // two texels per light: position + radius, color
+uniform usamplerBuffer clusterRanges;       // offset, count per cluster
+uniform usamplerBuffer clusterLightIndices;
+uniform mat4 clusterViewMatrices[4];
+uniform vec4 clusterViewports[4];
+uniform ivec3 clusterGridSize;
+uniform vec2 clusterDepthScaleBias;         // slice = log(depth) * x + y
+
+vec3 clusteredLighting(vec3 worldPosition, vec3 normal, vec3 albedo, int viewIndex) {
+    vec4 viewport = clusterViewports[viewIndex];
+    ivec2 tile = ivec2((gl_FragCoord.xy - viewport.xy) / viewport.zw * vec2(clusterGridSize.xy));
+    tile = clamp(tile, ivec2(0), clusterGridSize.xy - 1);
+
+    float depth = -(clusterViewMatrices[viewIndex] * vec4(worldPosition, 1.0)).z;
+    int slice = int(floor(log(max(depth, 1e-4)) * clusterDepthScaleBias.x + clusterDepthScaleBias.y));
+    slice = clamp(slice, 0, clusterGridSize.z - 1);
+
+    int cluster = viewIndex * clusterGridSize.x * clusterGridSize.y * clusterGridSize.z +
+                  (slice * clusterGridSize.y + tile.y) * clusterGridSize.x + tile.x;
+    uvec2 range = texelFetch(clusterRanges, cluster).xy;
+
+    vec3 result = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++) {
+        int light = int(texelFetch(clusterLightIndices, int(range.x + i)).r);
+        vec4 positionRadius = texelFetch(clusterLightData, light * 2);
+        vec3 color = texelFetch(clusterLightData, light * 2 + 1).rgb;
+
+        vec3 toLight = positionRadius.xyz - worldPosition;
+        float distanceToLight = length(toLight);
+        float falloff = clamp(1.0 - distanceToLight / positionRadius.w, 0.0, 1.0);
+        float diffuse = max(dot(normal, toLight / max(distanceToLight, 1e-4)), 0.0);
+        result += albedo * color * diffuse * falloff * falloff;
+    }
+    return result;
+}
+)";
+
+    void init() {
+        glGenBuffers(1, &_lightBuffer);
+        glGenBuffers(1, &_rangeBuffer);
+        glGenBuffers(1, &_indexBuffer);
+        glGenTextures(1, &_lightTexture);
+        glGenTextures(1, &_rangeTexture);
+        glGenTextures(1, &_indexTexture);
+
+        _attach(_lightTexture, _lightBuffer, GL_RGBA32F);
+        _attach(_rangeTexture, _rangeBuffer, GL_RG32UI);
+        _attach(_indexTexture, _indexBuffer, GL_R32UI);
+
+        // depth slices are spaced exponentially between SLICE_NEAR and SLICE_FAR
+        _depthScale = CLUSTERS_Z / std::log(SLICE_FAR / SLICE_NEAR);
+        _depthBias = -CLUSTERS_Z * std::log(SLICE_NEAR) / std::log(SLICE_FAR / SLICE_NEAR);
+    }
+
+    static Locations getLocations(GLuint program) {
+        Locations locations;
+        locations.lightData = glGetUniformLocation(program, "clusterLightData");
+        locations.ranges = glGetUniformLocation(program, "clusterRanges");
+        locations.indices = glGetUniformLocation(program, "clusterLightIndices");
+        locations.viewMatrices = glGetUniformLocation(program, "clusterViewMatrices");
+        locations.viewports = glGetUniformLocation(program, "clusterViewports");
+        locations.gridSize = glGetUniformLocation(program, "clusterGridSize");
+        locations.depthScaleBias = glGetUniformLocation(program, "clusterDepthScaleBias");
+        return locations;
+    }
+
+    std::vector<PointLight> &lights() { return _lights; }
+
+    // update() ////////////////////////////////////////////////////////////////
+    //
+    //  Bins the current lights for every view and uploads the result.  Run
+    //      once per frame after the views and lights are final.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void update(const MultiView &views) {
+        auto start = std::chrono::steady_clock::now();
+
+        _numViews = views.numViews();
+        const size_t numClusters = (size_t) _numViews * CLUSTERS_PER_VIEW;
+        FrameArray<uint32_t> counts(frameArena(), numClusters);
+        FrameArray<uint32_t> ranges(frameArena(), numClusters * 2);     // offset, count per cluster
+        FrameArray<ClusterBox> boxes(frameArena(), (size_t) _numViews * _lights.size());
+        counts.assign(numClusters, 0);
+        ranges.assign(numClusters * 2, 0);
+
+        // first pass: find each light's cluster box per view and count
+        for (int v = 0; v < _numViews; v++) {
+            for (uint32_t light = 0; light < _lights.size(); light++) {
+                ClusterBox box;
+                if (!_clusterBox(views, v, _lights[light], box)) continue;
+                box.light = light;
+                box.view = v;
+                boxes.push_back(box);
+                _forEachCluster(box, [&counts](size_t cluster) { counts[cluster]++; });
+            }
+        }
+
+        // prefix sum into offsets, capping the list at MAX_LIGHT_INDICES
+        uint32_t offset = 0;
+        for (size_t cluster = 0; cluster < numClusters; cluster++) {
+            const uint32_t count = std::min<uint32_t>(counts[cluster], MAX_LIGHT_INDICES - offset);
+            ranges[cluster * 2] = offset;
+            ranges[cluster * 2 + 1] = count;
+            counts[cluster] = 0;
+            offset += count;
+        }
+
+        // second pass: fill in the indices
+        FrameArray<uint32_t> indices(frameArena(), std::max<uint32_t>(offset, 1));
+        indices.assign(std::max<uint32_t>(offset, 1), 0);
+        for (const ClusterBox &box : boxes) {
+            _forEachCluster(box, [&counts, &ranges, &indices, &box](size_t cluster) {
+                if (counts[cluster] < ranges[cluster * 2 + 1]) {
+                    indices[ranges[cluster * 2] + counts[cluster]++] = box.light;
+                }
+            });
+        }
+        _numIndices = offset;
+
+        _upload(_lightBuffer, std::max<size_t>(_lights.size(), 1) * sizeof(PointLight), _lights.data());
+        _upload(_rangeBuffer, ranges.size() * sizeof(uint32_t), ranges.data());
+        _upload(_indexBuffer, indices.size() * sizeof(uint32_t), indices.data());
+
+        for (int v = 0; v < _numViews; v++) {
+            const MultiView::View &view = views.view(v);
+            _viewMatrices[v] = view.viewMtx;
+            _viewports[v] = glm::vec4((float) view.x, (float) view.y, (float) view.width, (float) view.height);
+        }
+
+        _binMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // apply() /////////////////////////////////////////////////////////////////
+    //
+    //  Binds the light buffers and sets the cluster uniforms for the program
+    //      currently in use.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void apply(const Locations &locations) const {
+        glActiveTexture(GL_TEXTURE0 + LIGHT_DATA_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, _lightTexture);
+        glActiveTexture(GL_TEXTURE0 + RANGES_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, _rangeTexture);
+        glActiveTexture(GL_TEXTURE0 + INDICES_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, _indexTexture);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUniform1i(locations.lightData, LIGHT_DATA_UNIT);
+        glUniform1i(locations.ranges, RANGES_UNIT);
+        glUniform1i(locations.indices, INDICES_UNIT);
+        glUniformMatrix4fv(locations.viewMatrices, _numViews, GL_FALSE, &_viewMatrices[0][0][0]);
+        glUniform4fv(locations.viewports, _numViews, &_viewports[0][0]);
+        glUniform3i(locations.gridSize, CLUSTERS_X, CLUSTERS_Y, CLUSTERS_Z);
+        glUniform2f(locations.depthScaleBias, _depthScale, _depthBias);
+    }
+
+    double binMilliseconds() const { return _binMilliseconds; }
+    size_t numIndices() const { return _numIndices; }
+
+private:
+    static constexpr float SLICE_NEAR = 1.0f;        // everything closer shares the first slice
+    static constexpr float SLICE_FAR = 1000.0f;
+
+    struct ClusterBox {
+        uint32_t light;
+        int view;
+        int x0, x1, y0, y1, z0, z1;      // inclusive cluster ranges
+    };
+
+    static void _attach(GLuint texture, GLuint buffer, GLenum format) {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    static void _upload(GLuint buffer, size_t size, const void *data) {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, size, nullptr, GL_STREAM_DRAW);   // orphan last frame's copy
+        if (data) glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    int _slice(float depth) const {
+        const int slice = (int) std::floor(std::log(std::max(depth, 1e-4f)) * _depthScale + _depthBias);
+        return glm::clamp(slice, 0, CLUSTERS_Z - 1);
+    }
+
+    // _clusterBox() ///////////////////////////////////////////////////////////
+    //
+    //  Conservative range of clusters a light's sphere can touch in a view:
+    //      depth from the sphere's view space extent, screen tiles from the
+    //      projected corners of its view space bounding box (the whole screen
+    //      if the box reaches behind the camera).
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    bool _clusterBox(const MultiView &views, int v, const PointLight &light, ClusterBox &box) const {
+        const MultiView::View &view = views.view(v);
+        const glm::vec4 center = view.viewMtx * glm::vec4(light.position, 1.0f);
+        const float nearDepth = -center.z - light.radius, farDepth = -center.z + light.radius;
+        if (farDepth <= 0.0f || nearDepth > SLICE_FAR) return false;
+
+        box.z0 = _slice(nearDepth);
+        box.z1 = _slice(farDepth);
+        box.x0 = 0, box.x1 = CLUSTERS_X - 1;
+        box.y0 = 0, box.y1 = CLUSTERS_Y - 1;
+        if (nearDepth <= 0.0f) return true;
+
+        float minX = 1.0f, maxX = -1.0f, minY = 1.0f, maxY = -1.0f;
+        for (int corner = 0; corner < 8; corner++) {
+            const glm::vec4 point(center.x + ((corner & 1) ? light.radius : -light.radius),
+                                  center.y + ((corner & 2) ? light.radius : -light.radius),
+                                  center.z + ((corner & 4) ? light.radius : -light.radius), 1.0f);
+            const glm::vec4 clip = view.projMtx * point;
+            minX = std::min(minX, clip.x / clip.w);
+            maxX = std::max(maxX, clip.x / clip.w);
+            minY = std::min(minY, clip.y / clip.w);
+            maxY = std::max(maxY, clip.y / clip.w);
+        }
+        if (maxX < -1.0f || minX > 1.0f || maxY < -1.0f || minY > 1.0f) return false;
+
+        box.x0 = glm::clamp((int) std::floor((minX * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1);
+        box.x1 = glm::clamp((int) std::floor((maxX * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1);
+        box.y0 = glm::clamp((int) std::floor((minY * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1);
+        box.y1 = glm::clamp((int) std::floor((maxY * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1);
+        return true;
+    }
+
+    template<typename Visitor>
+    static void _forEachCluster(const ClusterBox &box, Visitor visit) {
+        const size_t base = (size_t) box.view * CLUSTERS_PER_VIEW;
+        for (int z = box.z0; z <= box.z1; z++) {
+            for (int y = box.y0; y <= box.y1; y++) {
+                for (int x = box.x0; x <= box.x1; x++) {
+                    visit(base + ((size_t) z * CLUSTERS_Y + y) * CLUSTERS_X + x);
+                }
+            }
+        }
+    }
+
+    std::vector<PointLight> _lights;
+
+    size_t _numIndices = 0;
+
+    int _numViews = 1;
+    glm::mat4 _viewMatrices[MultiView::MAX_VIEWS];
+    glm::vec4 _viewports[MultiView::MAX_VIEWS];
+    float _depthScale = 0.0f, _depthBias = 0.0f;
+    double _binMilliseconds = 0.0;
+
+    GLuint _lightBuffer = 0, _rangeBuffer = 0, _indexBuffer = 0;
+    GLuint _lightTexture = 0, _rangeTexture = 0, _indexTexture = 0;
+};
+
+#endif //A3_CLUSTEREDLIGHTS_H
@@ -0,0 +1,326 @@
+//
+// Asynchronous frame capture.
+//
+// Each captured frame is read with glReadPixels into the next pixel buffer
+// object of a small ring, so the read is only queued on the GPU.  A fence
+// marks when it lands; frames later the PBO is mapped (only once the fence
+// has signaled, never waiting on it) and the pixels copied into a
+// preallocated buffer that a background thread writes out, either as one
+// raw RGBA stream or as a numbered PPM sequence.  If the ring or the writer
+// falls behind, frames are dropped rather than stalling.  Every captured
+// frame keeps its number either way: PPM files skip the dropped numbers and
+// frames.txt lists them for the raw stream.
+//
+
+#ifndef A3_FRAMECAPTURE_H
+#define A3_FRAMECAPTURE_H
+
+#include <GL/glew.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Allocators.h"
+
+class FrameCapture {
+public:
+    enum Format {
+        RAW_RGBA,                        // frames.rgba plus frames.txt describing it
+        PPM_SEQUENCE                     // frame_000000.ppm, frame_000001.ppm, ...
+    };
+
+    // start() /////////////////////////////////////////////////////////////////
+    //
+    //  Allocates the PBO ring and writer buffers for width x height frames
+    //      and starts the writer thread.  Call with the context current.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    bool start(const std::string &directory, GLsizei width, GLsizei height, Format format) {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error) {
+            fprintf(stderr, "[ERROR]: Could not create capture directory \"%s\"\n", directory.c_str());
+            return false;
+        }
+
+        _directory = directory;
+        _width = width;
+        _height = height;
+        _format = format;
+        _frameSize = (size_t) width * height * 4;
+        _frameIndex = 0;
+        _written = 0;
+        _dropped = 0;
+        _nextWritten = 0;
+        _droppedRanges.clear();
+
+        if (_format == RAW_RGBA) {
+            _rawFile = fopen((_directory + "/frames.rgba").c_str(), "wb");
+            if (!_rawFile) {
+                fprintf(stderr, "[ERROR]: Could not open capture file in \"%s\"\n", directory.c_str());
+                return false;
+            }
+        }
+
+        glGenBuffers(NUM_PBOS, _pbos);
+        for (int i = 0; i < NUM_PBOS; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, _pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, _frameSize, nullptr, GL_STREAM_READ);
+            _slots[i] = {nullptr, 0};
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        _nextPbo = 0;
+
+        _buffers.init(NUM_WRITER_BUFFERS, std::vector<unsigned char>(_frameSize));
+        _firstJob = 0;
+        _numJobs = 0;
+
+        _stop = false;
+        _writer = std::thread(&FrameCapture::_writerLoop, this);
+        _active = true;
+        return true;
+    }
+
+    // stop() //////////////////////////////////////////////////////////////////
+    //
+    //  Collects whatever is still in flight (this is the one place we wait,
+    //      on the GPU and for writer buffers), flushes the writer and
+    //      releases everything.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void stop() {
+        if (!_active) return;
+
+        for (int i = 0; i < NUM_PBOS; i++) _collect((_nextPbo + i) % NUM_PBOS, true);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _workReady.notify_all();
+        _writer.join();
+
+        glDeleteBuffers(NUM_PBOS, _pbos);
+        if (_rawFile) {
+            fclose(_rawFile);
+            _rawFile = nullptr;
+
+            // frames dropped after the last one written never reached the writer
+            if (_nextWritten < _frameIndex) _droppedRanges.push_back({_nextWritten, _frameIndex - 1});
+            _writeDescription();
+        }
+        _buffers.clear();
+        _active = false;
+
+        fprintf(stdout, "[INFO]: capture wrote %llu frames to \"%s\", dropped %llu\n",
+                (unsigned long long) _written, _directory.c_str(), (unsigned long long) _dropped);
+    }
+
+    bool isActive() const { return _active; }
+
+    // captureFrame() //////////////////////////////////////////////////////////
+    //
+    //  Call after rendering and before swapping buffers.  Hands any completed
+    //      reads to the writer and queues a read of the current back buffer.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void captureFrame() {
+        if (!_active) return;
+
+        // the slot we are about to reuse holds the oldest read in flight
+        _collect(_nextPbo, false);
+        if (_slots[_nextPbo].fence) {
+            _dropped++;
+            _frameIndex++;               // still numbered, so the gap shows up in the output
+            return;
+        }
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, _pbos[_nextPbo]);
+        glReadBuffer(GL_BACK);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, _width, _height, GL_RGBA, GL_UNSIGNED_BYTE, (void *) 0);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        _slots[_nextPbo] = {glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), _frameIndex++};
+        _nextPbo = (_nextPbo + 1) % NUM_PBOS;
+    }
+
+private:
+    static const int NUM_PBOS = 4;
+    static const int NUM_WRITER_BUFFERS = 6;
+
+    struct Slot {
+        GLsync fence;
+        unsigned long long frame;
+    };
+
+    struct WriteJob {
+        std::vector<unsigned char> *pixels;
+        unsigned long long frame;
+    };
+
+    // _collect() //////////////////////////////////////////////////////////////
+    //
+    //  If the read in slot has finished (or wait is set), copies it out of
+    //      the PBO into a free writer buffer and queues it for writing.  With
+    //      wait set it also waits for the writer to free a buffer.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void _collect(int slot, bool wait) {
+        Slot &pending = _slots[slot];
+        if (!pending.fence) return;
+
+        GLenum status = glClientWaitSync(pending.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                         wait ? 1000000000ull : 0);
+        if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED) {
+            if (!wait) return;
+        }
+        glDeleteSync(pending.fence);
+        pending.fence = nullptr;
+
+        std::vector<unsigned char> *buffer = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (wait) _bufferFree.wait(lock, [this] { return _buffers.available() > 0; });
+            buffer = _buffers.acquire();
+        }
+        if (!buffer) {
+            _dropped++;                  // the writer is behind; skip rather than stall
+            return;
+        }
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, _pbos[slot]);
+        void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, _frameSize, GL_MAP_READ_BIT);
+        if (mapped) {
+            memcpy(buffer->data(), mapped, _frameSize);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (mapped) {
+            // every queued job holds a buffer, so the ring can never be full here
+            _jobs[(_firstJob + _numJobs++) % NUM_WRITER_BUFFERS] = {buffer, pending.frame};
+            _workReady.notify_one();
+        } else {
+            _buffers.release(buffer);
+            _dropped++;
+        }
+    }
+
+    void _writerLoop() {
+        std::vector<unsigned char> row;
+        while (true) {
+            WriteJob job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _workReady.wait(lock, [this] { return _stop || _numJobs > 0; });
+                if (_numJobs == 0) return;          // stopping and drained
+                job = _jobs[_firstJob];
+                _firstJob = (_firstJob + 1) % NUM_WRITER_BUFFERS;
+                _numJobs--;
+            }
+
+            if (_format == RAW_RGBA) {
+                fwrite(job.pixels->data(), 1, _frameSize, _rawFile);
+            } else {
+                _writePPM(job, row);
+            }
+
+            // jobs arrive in frame order, so any number skipped was dropped
+            if (job.frame > _nextWritten) _droppedRanges.push_back({_nextWritten, job.frame - 1});
+            _nextWritten = job.frame + 1;
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _written++;
+                _buffers.release(job.pixels);
+            }
+            _bufferFree.notify_one();
+        }
+    }
+
+    // _writeDescription() /////////////////////////////////////////////////////
+    //
+    //  frames.txt for the raw stream.  The stream holds every frame number
+    //      from 0 to captured - 1 except those on the dropped line, in order.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void _writeDescription() {
+        FILE *description = fopen((_directory + "/frames.txt").c_str(), "w");
+        if (!description) {
+            fprintf(stderr, "[ERROR]: Could not write frames.txt in \"%s\"\n", _directory.c_str());
+            return;
+        }
+
+        fprintf(description, "width %d\nheight %d\nframes %llu\ncaptured %llu\nformat RGBA8, bottom row first\n",
+                _width, _height, (unsigned long long) _written, _frameIndex);
+        fprintf(description, "dropped");
+        if (_droppedRanges.empty()) fprintf(description, " none");
+        for (const std::pair<unsigned long long, unsigned long long> &range : _droppedRanges) {
+            if (range.first == range.second) fprintf(description, " %llu", range.first);
+            else fprintf(description, " %llu-%llu", range.first, range.second);
+        }
+        fprintf(description, "\n");
+        fclose(description);
+    }
+
+    // PPM rows go top to bottom and carry no alpha
+    void _writePPM(const WriteJob &job, std::vector<unsigned char> &row) {
+        char name[32];
+        snprintf(name, sizeof(name), "/frame_%06llu.ppm", job.frame);
+        FILE *file = fopen((_directory + name).c_str(), "wb");
+        if (!file) return;
+
+        fprintf(file, "P6\n%d %d\n255\n", _width, _height);
+        row.resize((size_t) _width * 3);
+        for (GLsizei y = _height - 1; y >= 0; y--) {
+            const unsigned char *source = job.pixels->data() + (size_t) y * _width * 4;
+            for (GLsizei x = 0; x < _width; x++) {
+                row[x * 3 + 0] = source[x * 4 + 0];
+                row[x * 3 + 1] = source[x * 4 + 1];
+                row[x * 3 + 2] = source[x * 4 + 2];
+            }
+            fwrite(row.data(), 1, row.size(), file);
+        }
+        fclose(file);
+    }
+
+    bool _active = false;
+    std::string _directory;
+    GLsizei _width = 0, _height = 0;
+    Format _format = RAW_RGBA;
+    size_t _frameSize = 0;
+    FILE *_rawFile = nullptr;
+
+    GLuint _pbos[NUM_PBOS] = {};
+    Slot _slots[NUM_PBOS] = {};
+    int _nextPbo = 0;
+    unsigned long long _frameIndex = 0;
+    unsigned long long _dropped = 0;
+
+    // writer thread only while it runs; inclusive ranges of frame numbers
+    unsigned long long _nextWritten = 0;
+    std::vector<std::pair<unsigned long long, unsigned long long>> _droppedRanges;
+
+    std::mutex _mutex;                   // guards everything below
+    std::condition_variable _workReady;
+    std::condition_variable _bufferFree;
+    ObjectPool<std::vector<unsigned char>> _buffers;    // every writer buffer, allocated in start()
+    WriteJob _jobs[NUM_WRITER_BUFFERS] = {};            // ring of frames waiting for the writer
+    int _firstJob = 0, _numJobs = 0;
+    unsigned long long _written = 0;
+    bool _stop = false;
+
+    std::thread _writer;
+};
+
+#endif //A3_FRAMECAPTURE_H
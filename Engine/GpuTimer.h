@@ -0,0 +1,69 @@
+//
+// Non-blocking GPU timer.  Keeps a small ring of GL_TIME_ELAPSED queries and
+// only reads back results the driver says are available, so timing a pass
+// never stalls the pipeline.
+//
+
+#ifndef A3_GPUTIMER_H
+#define A3_GPUTIMER_H
+
+#include <GL/glew.h>
+
+class GpuTimer {
+public:
+    void init() {
+        glGenQueries(NUM_QUERIES, _queries);
+        for (bool &issued : _issued) issued = false;
+    }
+
+    void shutdown() { glDeleteQueries(NUM_QUERIES, _queries); }
+
+    void begin() {
+        _collect();
+        glBeginQuery(GL_TIME_ELAPSED, _queries[_next]);
+    }
+
+    void end() {
+        glEndQuery(GL_TIME_ELAPSED);
+        _issued[_next] = true;
+        _next = (_next + 1) % NUM_QUERIES;
+    }
+
+    // the most recently completed measurement, in milliseconds
+    double lastMilliseconds() const { return _lastMilliseconds; }
+
+    // mean of the measurements completed since the last resetAverage()
+    double averageMilliseconds() const { return _samples > 0 ? _totalMilliseconds / _samples : 0.0; }
+    void resetAverage() {
+        _totalMilliseconds = 0.0;
+        _samples = 0;
+    }
+
+private:
+    static const int NUM_QUERIES = 4;
+
+    void _collect() {
+        // the query we are about to reuse is the oldest one in flight
+        if (!_issued[_next]) return;
+        GLint available = GL_FALSE;
+        glGetQueryObjectiv(_queries[_next], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(_queries[_next], GL_QUERY_RESULT, &nanoseconds);
+            _lastMilliseconds = nanoseconds / 1.0e6;
+            _totalMilliseconds += _lastMilliseconds;
+            _samples++;
+        }
+        // if it still isn't ready we drop that sample rather than wait on it
+        _issued[_next] = false;
+    }
+
+    GLuint _queries[NUM_QUERIES] = {};
+    bool _issued[NUM_QUERIES] = {};
+    int _next = 0;
+    double _lastMilliseconds = 0.0;
+    double _totalMilliseconds = 0.0;
+    int _samples = 0;
+};
+
+#endif //A3_GPUTIMER_H
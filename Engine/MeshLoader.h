@@ -0,0 +1,573 @@
+//
+// Asynchronous mesh import.
+//
+// Wavefront OBJ models are parsed on worker threads and run through the
+// MeshOptimizer passes: vertices are welded, triangles reordered for the
+// vertex cache, vertices reordered for fetch locality, and a chain of
+// simplified levels of detail is built.  The result is packed (12 byte
+// PackedFormats vertices, 16-bit indices where they fit) into one block that
+// is written beside the source as "<model>.meshcache"; later launches load
+// that block with a single read and skip the pipeline entirely.  The main
+// thread only creates the GL buffers, so until then getMesh() returns null
+// and callers keep drawing whatever they drew before.  Meshes live in an
+// ObjectPool sized in init(), so a Mesh pointer stays valid while more are
+// requested.
+//
+
+#ifndef A3_MESHLOADER_H
+#define A3_MESHLOADER_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Allocators.h"
+#include "MeshOptimizer.h"
+#include "PackedFormats.h"
+
+class MeshLoader {
+public:
+    typedef size_t Handle;
+    static const Handle NO_MESH = (Handle) -1;
+
+    static const int MAX_LODS = 4;
+    static const size_t MAX_MESHES = 64;
+
+    struct Lod {
+        GLuint firstIndex;
+        GLsizei numIndices;
+        GLint baseVertex;
+        float error;                     // roughly how far, in model units, this level strays from the original
+    };
+
+    struct Mesh {
+        GLuint vao, vertexBuffer, indexBuffer;
+        GLenum indexType;
+        glm::vec3 center;                // vertex positions are relative to center, scaled by extent
+        float extent;
+        float radius;                    // bounding sphere around center
+        int numLods;
+        Lod lods[MAX_LODS];              // finest first
+    };
+
+    // init() //////////////////////////////////////////////////////////////////
+    //
+    //  Starts the workers.  Nothing here touches OpenGL.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void init(unsigned int numWorkers = 1) {
+        _entryPool.init(MAX_MESHES);
+        _entries.clear();
+        _entries.reserve(MAX_MESHES);
+
+        _stop = false;
+        for (unsigned int i = 0; i < numWorkers; i++) {
+            _workers.emplace_back(&MeshLoader::_workerLoop, this);
+        }
+    }
+
+    // shutdown() //////////////////////////////////////////////////////////////
+    //
+    //  Stops the workers and releases every GL object the loader owns.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _jobReady.notify_all();
+        for (std::thread &worker : _workers) worker.join();
+        _workers.clear();
+
+        for (Entry *entry : _entries) {
+            if (entry->ready) {
+                glDeleteVertexArrays(1, &entry->mesh.vao);
+                glDeleteBuffers(1, &entry->mesh.vertexBuffer);
+                glDeleteBuffers(1, &entry->mesh.indexBuffer);
+            }
+            _entryPool.release(entry);
+        }
+        _entries.clear();
+        _entryPool.clear();
+    }
+
+    // request() ///////////////////////////////////////////////////////////////
+    //
+    //  Queues an OBJ model for import and returns a handle to it immediately,
+    //      or NO_MESH once MAX_MESHES have been requested.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    Handle request(const std::string &path) {
+        Entry *entry = _entryPool.acquire();
+        if (!entry) {
+            fprintf(stderr, "[ERROR]: Mesh limit of %zu reached, not loading \"%s\"\n", MAX_MESHES, path.c_str());
+            return NO_MESH;
+        }
+        *entry = Entry();
+        Handle handle = _entries.size();
+        _entries.push_back(entry);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobs.push_back({handle, path});
+        }
+        _jobReady.notify_one();
+
+        return handle;
+    }
+
+    // the mesh for a handle once its buffers exist, otherwise nullptr
+    const Mesh *getMesh(Handle handle) const {
+        if (handle == NO_MESH || !_entries.at(handle)->ready) return nullptr;
+        return &_entries[handle]->mesh;
+    }
+
+    // update() ////////////////////////////////////////////////////////////////
+    //
+    //  Called once per frame on the main thread.  Creates the buffers for any
+    //      meshes the workers have finished; returns true if there were any.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    bool update() {
+        bool uploaded = false;
+        while (true) {
+            Block block;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_finished.empty()) break;
+                block = std::move(_finished.front());
+                _finished.pop_front();
+            }
+            _upload(*_entries.at(block.handle), block.data);
+            uploaded = true;
+        }
+        return uploaded;
+    }
+
+private:
+    static const uint32_t CACHE_MAGIC = 0x4348534D;    // "MSHC"
+    static const uint32_t CACHE_VERSION = 1;
+    static const size_t MIN_LOD_TRIANGLES = 32;        // no point simplifying below this
+
+    struct Entry {
+        Mesh mesh = {};
+        bool ready = false;
+    };
+
+    struct Job {
+        Handle handle;
+        std::string path;
+    };
+
+    // a whole .meshcache file: the header, the level table, the packed
+    //  vertices of every level and then their indices
+    struct Block {
+        Handle handle;
+        std::vector<unsigned char> data;
+    };
+
+    struct CacheHeader {
+        uint32_t magic, version;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        float center[3], extent, radius;
+        uint32_t numLods, numVertices, numIndices, indexSize;
+    };
+
+    struct CacheLod {
+        uint32_t firstIndex, numIndices, baseVertex;
+        float error;
+    };
+
+    // byte size a block with this header must have
+    static size_t _blockSize(const CacheHeader &header) {
+        return sizeof(CacheHeader) + header.numLods * sizeof(CacheLod) +
+               (size_t) header.numVertices * sizeof(PackedFormats::PackedVertex) +
+               (size_t) header.numIndices * header.indexSize;
+    }
+
+    static void _upload(Entry &entry, const std::vector<unsigned char> &data) {
+        CacheHeader header;
+        memcpy(&header, data.data(), sizeof(header));
+        const unsigned char *lods = data.data() + sizeof(CacheHeader);
+        const unsigned char *vertices = lods + header.numLods * sizeof(CacheLod);
+        const unsigned char *indices = vertices + (size_t) header.numVertices * sizeof(PackedFormats::PackedVertex);
+
+        Mesh &mesh = entry.mesh;
+        mesh.indexType = header.indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+        mesh.center = glm::vec3(header.center[0], header.center[1], header.center[2]);
+        mesh.extent = header.extent;
+        mesh.radius = header.radius;
+        mesh.numLods = (int) header.numLods;
+        for (int i = 0; i < mesh.numLods; i++) {
+            CacheLod lod;
+            memcpy(&lod, lods + i * sizeof(CacheLod), sizeof(lod));
+            mesh.lods[i] = {lod.firstIndex, (GLsizei) lod.numIndices, (GLint) lod.baseVertex, lod.error};
+        }
+
+        glGenVertexArrays(1, &mesh.vao);
+        glBindVertexArray(mesh.vao);
+
+        glGenBuffers(1, &mesh.vertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, (size_t) header.numVertices * sizeof(PackedFormats::PackedVertex), vertices,
+                     GL_STATIC_DRAW);
+        PackedFormats::setupVertexAttributes();
+
+        glGenBuffers(1, &mesh.indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, (size_t) header.numIndices * header.indexSize, indices, GL_STATIC_DRAW);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        entry.ready = true;
+    }
+
+    void _workerLoop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _jobReady.wait(lock, [this] { return _stop || !_jobs.empty(); });
+                if (_stop) return;
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+
+            Block block;
+            block.handle = job.handle;
+            if (!_loadMesh(job, block.data)) continue;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finished.push_back(std::move(block));
+        }
+    }
+
+    static bool _sourceStamp(const std::string &path, uint64_t &size, int64_t &time) {
+        std::error_code error;
+        size = std::filesystem::file_size(path, error);
+        if (error) return false;
+        time = (int64_t) std::filesystem::last_write_time(path, error).time_since_epoch().count();
+        return !error;
+    }
+
+    static bool _loadMesh(const Job &job, std::vector<unsigned char> &data) {
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        if (!_sourceStamp(job.path, sourceSize, sourceTime)) {
+            fprintf(stderr, "[ERROR]: Could not find mesh \"%s\"\n", job.path.c_str());
+            return false;
+        }
+
+        const std::string cachePath = job.path + ".meshcache";
+        if (_readCache(cachePath, sourceSize, sourceTime, data)) return true;
+
+        std::vector<MeshOptimizer::Vertex> vertices;
+        if (!_importOBJ(job.path, vertices)) return false;
+
+        _buildBlock(job.path, vertices, sourceSize, sourceTime, data);
+        _writeCache(cachePath, data);
+        return true;
+    }
+
+    // _importOBJ() ////////////////////////////////////////////////////////////
+    //
+    //  Reads the v, vn and f records of an OBJ file into a triangle soup.
+    //      Polygons are fanned into triangles and faces without normals get
+    //      their flat face normal.  Everything else is ignored.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    static bool _importOBJ(const std::string &path, std::vector<MeshOptimizer::Vertex> &soup) {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (!file) {
+            fprintf(stderr, "[ERROR]: Could not open mesh \"%s\"\n", path.c_str());
+            return false;
+        }
+        std::string text;
+        char chunk[65536];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) text.append(chunk, read);
+        fclose(file);
+
+        std::vector<glm::vec3> positions, normals;
+        std::vector<int> cornerPositions, cornerNormals;
+        int lineNumber = 0;
+        text.push_back('\n');
+        for (size_t lineStart = 0; lineStart < text.size();) {
+            const size_t lineEnd = text.find('\n', lineStart);
+            text[lineEnd] = '\0';                                      // so the parsers stop at the line's end
+            const char *line = text.c_str() + lineStart;
+            lineStart = lineEnd + 1;
+            lineNumber++;
+
+            char *cursor;
+            if (line[0] == 'v' && line[1] == ' ') {
+                glm::vec3 position;
+                position.x = strtof(line + 2, &cursor);
+                position.y = strtof(cursor, &cursor);
+                position.z = strtof(cursor, &cursor);
+                positions.push_back(position);
+            } else if (line[0] == 'v' && line[1] == 'n' && line[2] == ' ') {
+                glm::vec3 normal;
+                normal.x = strtof(line + 3, &cursor);
+                normal.y = strtof(cursor, &cursor);
+                normal.z = strtof(cursor, &cursor);
+                normals.push_back(normal);
+            } else if (line[0] == 'f' && line[1] == ' ') {
+                // each corner is v, v/vt, v//vn or v/vt/vn, 1-based or negative from the end
+                cornerPositions.clear();
+                cornerNormals.clear();
+                cursor = (char *) line + 2;
+                while (true) {
+                    char *end;
+                    long position = strtol(cursor, &end, 10);
+                    if (end == cursor) break;
+                    long normal = 0;
+                    cursor = end;
+                    if (*cursor == '/') {
+                        strtol(++cursor, &end, 10);                    // texture coordinate, unused
+                        cursor = end;
+                        if (*cursor == '/') {
+                            normal = strtol(++cursor, &end, 10);
+                            cursor = end;
+                        }
+                    }
+                    cornerPositions.push_back((int) (position < 0 ? (long) positions.size() + position : position - 1));
+                    cornerNormals.push_back((int) (normal < 0 ? (long) normals.size() + normal : normal - 1));
+                }
+
+                for (size_t i = 0; i < cornerPositions.size(); i++) {
+                    const bool badNormal = cornerNormals[i] >= (int) normals.size() ||
+                                           (cornerNormals[i] < 0 && cornerNormals[i] != -1);
+                    if (cornerPositions[i] < 0 || cornerPositions[i] >= (int) positions.size() || badNormal) {
+                        fprintf(stderr, "[ERROR]: Bad face index in \"%s\" on line %d\n", path.c_str(), lineNumber);
+                        return false;
+                    }
+                }
+
+                for (size_t i = 2; i < cornerPositions.size(); i++) {
+                    const size_t corners[3] = {0, i - 1, i};
+                    const glm::vec3 &a = positions[cornerPositions[0]];
+                    const glm::vec3 &b = positions[cornerPositions[i - 1]];
+                    const glm::vec3 &c = positions[cornerPositions[i]];
+                    glm::vec3 faceNormal = glm::cross(b - a, c - a);
+                    const float area = glm::length(faceNormal);
+                    if (area <= 0.0f) continue;                        // degenerate, drop it
+                    faceNormal /= area;
+
+                    for (size_t corner : corners) {
+                        const int normal = cornerNormals[corner];
+                        soup.push_back({positions[cornerPositions[corner]],
+                                        normal >= 0 ? glm::normalize(normals[normal]) : faceNormal});
+                    }
+                }
+            }
+        }
+
+        if (soup.empty()) {
+            fprintf(stderr, "[ERROR]: Mesh \"%s\" has no triangles\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // _buildBlock() ///////////////////////////////////////////////////////////
+    //
+    //  Runs the optimization passes over a triangle soup, builds the LOD
+    //      chain and packs it all into cache block form.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    static void _buildBlock(const std::string &path, std::vector<MeshOptimizer::Vertex> &vertices,
+                            uint64_t sourceSize, int64_t sourceTime, std::vector<unsigned char> &data) {
+        struct Level {
+            std::vector<MeshOptimizer::Vertex> vertices;
+            std::vector<uint32_t> indices;
+            float error;
+        };
+        std::vector<Level> levels(1);
+        Level &full = levels[0];
+        full.vertices.swap(vertices);
+        full.error = 0.0f;
+
+        const size_t soupVertices = full.vertices.size();
+        MeshOptimizer::deduplicate(full.vertices, full.indices);
+        const float missesBefore = MeshOptimizer::cacheMissRatio(full.indices, full.vertices.size());
+        MeshOptimizer::optimizeVertexCache(full.indices, full.vertices.size());
+        MeshOptimizer::optimizeVertexFetch(full.vertices, full.indices);
+        const float missesAfter = MeshOptimizer::cacheMissRatio(full.indices, full.vertices.size());
+
+        glm::vec3 lo(1e30f), hi(-1e30f);
+        for (const MeshOptimizer::Vertex &vertex : full.vertices) {
+            lo = glm::min(lo, vertex.position);
+            hi = glm::max(hi, vertex.position);
+        }
+        const glm::vec3 center = (lo + hi) * 0.5f;
+        const glm::vec3 halfSize = (hi - lo) * 0.5f;
+        const float extent = std::max(std::max(halfSize.x, halfSize.y), std::max(halfSize.z, 1e-6f));
+        float radius = 0.0f;
+        for (const MeshOptimizer::Vertex &vertex : full.vertices) {
+            radius = std::max(radius, glm::distance(vertex.position, center));
+        }
+
+        // each level clusters the full mesh on a grid twice as coarse as the last
+        //  attempt, kept only if it drops at least 40% of the previous level's triangles
+        for (float cellSize = extent / 32.0f; cellSize < 2.0f * extent && levels.size() < (size_t) MAX_LODS;
+             cellSize *= 2.0f) {
+            const size_t previousIndices = levels.back().indices.size();
+            if (previousIndices / 3 <= MIN_LOD_TRIANGLES) break;
+
+            Level level;
+            MeshOptimizer::simplify(levels[0].vertices, levels[0].indices, cellSize, level.vertices, level.indices);
+            if (level.indices.empty()) break;
+            if (level.indices.size() > previousIndices * 6 / 10) continue;
+
+            MeshOptimizer::optimizeVertexCache(level.indices, level.vertices.size());
+            MeshOptimizer::optimizeVertexFetch(level.vertices, level.indices);
+            level.error = cellSize;
+            levels.push_back(std::move(level));
+        }
+
+        CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, sourceSize, sourceTime,
+                              {center.x, center.y, center.z}, extent, radius,
+                              (uint32_t) levels.size(), 0, 0, 2};
+        for (const Level &level : levels) {
+            header.numVertices += (uint32_t) level.vertices.size();
+            header.numIndices += (uint32_t) level.indices.size();
+            if (level.vertices.size() > 0xFFFF) header.indexSize = 4;
+        }
+
+        data.resize(_blockSize(header));
+        unsigned char *lodCursor = data.data() + sizeof(CacheHeader);
+        unsigned char *vertexCursor = lodCursor + levels.size() * sizeof(CacheLod);
+        unsigned char *indexCursor = vertexCursor + (size_t) header.numVertices * sizeof(PackedFormats::PackedVertex);
+        memcpy(data.data(), &header, sizeof(header));
+
+        uint32_t firstIndex = 0, baseVertex = 0;
+        for (const Level &level : levels) {
+            const CacheLod lod = {firstIndex, (uint32_t) level.indices.size(), baseVertex, level.error};
+            memcpy(lodCursor, &lod, sizeof(lod));
+            lodCursor += sizeof(lod);
+
+            for (const MeshOptimizer::Vertex &vertex : level.vertices) {
+                const PackedFormats::PackedVertex packed = PackedFormats::packVertex(vertex.position - center,
+                                                                                     vertex.normal, extent);
+                memcpy(vertexCursor, &packed, sizeof(packed));
+                vertexCursor += sizeof(packed);
+            }
+            for (uint32_t index : level.indices) {
+                if (header.indexSize == 2) {
+                    const uint16_t shortIndex = (uint16_t) index;
+                    memcpy(indexCursor, &shortIndex, sizeof(shortIndex));
+                } else {
+                    memcpy(indexCursor, &index, sizeof(index));
+                }
+                indexCursor += header.indexSize;
+            }
+
+            firstIndex += (uint32_t) level.indices.size();
+            baseVertex += (uint32_t) level.vertices.size();
+        }
+
+        fprintf(stdout, "[INFO]: mesh \"%s\": %zu corners welded to %zu vertices, %zu triangles, ACMR %.2f -> %.2f, "
+                        "%zu LODs down to %zu triangles\n",
+                path.c_str(), soupVertices, levels[0].vertices.size(), levels[0].indices.size() / 3,
+                missesBefore, missesAfter, levels.size(), levels.back().indices.size() / 3);
+    }
+
+    // the block is the whole file, so loading it is a single read.  Every
+    //  level's range, and every index in it, is checked against the buffers,
+    //  so a corrupt cache is a miss rather than an out of range draw
+    static bool _readCache(const std::string &cachePath, uint64_t sourceSize, int64_t sourceTime,
+                           std::vector<unsigned char> &data) {
+        std::error_code error;
+        const uintmax_t fileSize = std::filesystem::file_size(cachePath, error);
+        if (error || fileSize < sizeof(CacheHeader)) return false;
+
+        FILE *file = fopen(cachePath.c_str(), "rb");
+        if (!file) return false;
+        data.resize((size_t) fileSize);
+        bool valid = fread(data.data(), 1, data.size(), file) == data.size();
+        fclose(file);
+
+        CacheHeader header = {};
+        if (valid) {
+            memcpy(&header, data.data(), sizeof(header));
+            valid = header.magic == CACHE_MAGIC && header.version == CACHE_VERSION &&
+                    header.sourceSize == sourceSize && header.sourceTime == sourceTime &&
+                    header.numLods > 0 && header.numLods <= (uint32_t) MAX_LODS &&
+                    (header.indexSize == 2 || header.indexSize == 4) && _blockSize(header) == data.size();
+        }
+        for (uint32_t i = 0; valid && i < header.numLods; i++) {
+            CacheLod lod;
+            memcpy(&lod, data.data() + sizeof(CacheHeader) + i * sizeof(CacheLod), sizeof(lod));
+            valid = _validLod(header, lod, data);
+        }
+        if (!valid) data.clear();
+        return valid;
+    }
+
+    static bool _validLod(const CacheHeader &header, const CacheLod &lod, const std::vector<unsigned char> &data) {
+        if (lod.numIndices == 0 || lod.numIndices % 3 != 0 ||
+            (uint64_t) lod.firstIndex + lod.numIndices > header.numIndices ||
+            lod.baseVertex >= header.numVertices) {
+            return false;
+        }
+
+        const unsigned char *indices = data.data() + sizeof(CacheHeader) + header.numLods * sizeof(CacheLod) +
+                                       (size_t) header.numVertices * sizeof(PackedFormats::PackedVertex);
+        for (uint32_t i = lod.firstIndex; i < lod.firstIndex + lod.numIndices; i++) {
+            uint32_t index = 0;
+            if (header.indexSize == 2) {
+                uint16_t shortIndex;
+                memcpy(&shortIndex, indices + (size_t) i * 2, sizeof(shortIndex));
+                index = shortIndex;
+            } else {
+                memcpy(&index, indices + (size_t) i * 4, sizeof(index));
+            }
+            if ((uint64_t) lod.baseVertex + index >= header.numVertices) return false;
+        }
+        return true;
+    }
+
+    static void _writeCache(const std::string &cachePath, const std::vector<unsigned char> &data) {
+        // write to a temporary and rename so a half written cache is never read
+        const std::string tempPath = cachePath + ".tmp";
+        FILE *file = fopen(tempPath.c_str(), "wb");
+        if (!file) return;
+
+        bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+        fclose(file);
+
+        std::error_code error;
+        if (written) std::filesystem::rename(tempPath, cachePath, error);
+        if (!written || error) std::filesystem::remove(tempPath, error);
+    }
+
+    ObjectPool<Entry> _entryPool;        // main thread only
+    std::vector<Entry *> _entries;       // by handle, reserved for MAX_MESHES
+
+    std::mutex _mutex;                   // guards everything below
+    std::condition_variable _jobReady;
+    std::deque<Job> _jobs;
+    std::deque<Block> _finished;
+    bool _stop = false;
+
+    std::vector<std::thread> _workers;
+};
+
+#endif //A3_MESHLOADER_H
@@ -0,0 +1,278 @@
+//
+// Offline mesh optimization passes.
+//
+// Imported meshes arrive as triangle soups with every corner its own vertex.
+// deduplicate() welds identical vertices, optimizeVertexCache() reorders the
+// triangles for the post-transform vertex cache (Forsyth's linear-speed
+// algorithm), optimizeVertexFetch() then renumbers the vertices in the order
+// the triangles first use them so fetches walk the vertex buffer forwards,
+// and simplify() builds coarser levels of detail by vertex clustering.  All
+// of it is plain CPU code meant for loader worker threads.
+//
+
+#ifndef A3_MESHOPTIMIZER_H
+#define A3_MESHOPTIMIZER_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+namespace MeshOptimizer {
+
+    struct Vertex {
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+
+    // deduplicate() ///////////////////////////////////////////////////////////
+    //
+    //  Welds bitwise identical vertices and rewrites indices to match.  Pass
+    //      an empty index list for an unindexed triangle soup.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void deduplicate(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices) {
+        struct Key {
+            uint32_t bits[6];
+            bool operator==(const Key &other) const { return memcmp(bits, other.bits, sizeof(bits)) == 0; }
+        };
+        struct KeyHash {
+            size_t operator()(const Key &key) const {
+                uint64_t hash = 14695981039346656037ull;                  // FNV-1a over the six words
+                for (uint32_t word : key.bits) hash = (hash ^ word) * 1099511628211ull;
+                return (size_t) hash;
+            }
+        };
+
+        if (indices.empty()) {
+            indices.resize(vertices.size());
+            for (size_t i = 0; i < indices.size(); i++) indices[i] = (uint32_t) i;
+        }
+
+        std::unordered_map<Key, uint32_t, KeyHash> unique;
+        unique.reserve(vertices.size());
+        std::vector<Vertex> welded;
+        std::vector<uint32_t> remap(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++) {
+            Key key;
+            memcpy(key.bits, &vertices[i].position, sizeof(glm::vec3));
+            memcpy(key.bits + 3, &vertices[i].normal, sizeof(glm::vec3));
+            auto inserted = unique.emplace(key, (uint32_t) welded.size());
+            if (inserted.second) welded.push_back(vertices[i]);
+            remap[i] = inserted.first->second;
+        }
+
+        for (uint32_t &index : indices) index = remap[index];
+        vertices.swap(welded);
+    }
+
+    // cacheMissRatio() ////////////////////////////////////////////////////////
+    //
+    //  Average vertex shader invocations per triangle (ACMR) through a FIFO
+    //      post-transform cache of cacheSize entries.  0.5 is the ideal for a
+    //      large regular grid, 3 means no reuse at all.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline float cacheMissRatio(const std::vector<uint32_t> &indices, size_t numVertices, int cacheSize = 16) {
+        if (indices.empty()) return 0.0f;
+
+        std::vector<uint32_t> insertedAt(numVertices, 0);  // miss count when the vertex entered, 0 if never
+        uint32_t misses = 0;
+        for (uint32_t index : indices) {
+            if (insertedAt[index] == 0 || misses - insertedAt[index] >= (uint32_t) cacheSize) {
+                misses++;
+                insertedAt[index] = misses;
+            }
+        }
+        return (float) misses / (float) (indices.size() / 3);
+    }
+
+    // optimizeVertexCache() ///////////////////////////////////////////////////
+    //
+    //  Reorders triangles greedily: each step emits the unemitted triangle
+    //      whose vertices score highest, where a vertex scores for sitting near
+    //      the front of a simulated LRU cache and for having few triangles
+    //      left (so stragglers get finished off instead of orphaned).
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void optimizeVertexCache(std::vector<uint32_t> &indices, size_t numVertices) {
+        const int CACHE_SIZE = 32;
+        const size_t numTriangles = indices.size() / 3;
+        if (numTriangles == 0) return;
+
+        auto vertexScore = [](int cachePosition, uint32_t remaining) {
+            if (remaining == 0) return -1.0f;
+            float score = 0.0f;
+            if (cachePosition >= 0) {
+                // the last triangle's three vertices score the same, so it's not a strip preference
+                score = cachePosition < 3 ? 0.75f
+                                          : std::pow(1.0f - (float) (cachePosition - 3) / (CACHE_SIZE - 3), 1.5f);
+            }
+            return score + 2.0f / std::sqrt((float) remaining);
+        };
+
+        // per-vertex lists of the triangles still to be emitted
+        std::vector<uint32_t> remaining(numVertices, 0), firstTriangle(numVertices + 1, 0);
+        for (uint32_t index : indices) remaining[index]++;
+        for (size_t v = 0; v < numVertices; v++) firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+        std::vector<uint32_t> adjacency(indices.size()), filled(numVertices, 0);
+        for (size_t t = 0; t < numTriangles; t++) {
+            for (int corner = 0; corner < 3; corner++) {
+                const uint32_t v = indices[t * 3 + corner];
+                adjacency[firstTriangle[v] + filled[v]++] = (uint32_t) t;
+            }
+        }
+
+        std::vector<int> cachePosition(numVertices, -1);
+        std::vector<float> score(numVertices);
+        for (size_t v = 0; v < numVertices; v++) score[v] = vertexScore(-1, remaining[v]);
+        std::vector<float> triangleScore(numTriangles);
+        for (size_t t = 0; t < numTriangles; t++) {
+            triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+        }
+        std::vector<bool> emitted(numTriangles, false);
+
+        std::vector<uint32_t> output;
+        output.reserve(indices.size());
+        std::vector<uint32_t> cache, nextCache;
+        cache.reserve(CACHE_SIZE + 3);
+        nextCache.reserve(CACHE_SIZE + 3);
+
+        size_t scanCursor = 0;
+        int64_t best = -1;
+        for (size_t step = 0; step < numTriangles; step++) {
+            // nothing cached scores: restart from the next triangle not yet emitted
+            if (best < 0) {
+                while (emitted[scanCursor]) scanCursor++;
+                best = (int64_t) scanCursor;
+            }
+
+            const uint32_t *triangle = &indices[best * 3];
+            emitted[best] = true;
+            for (int corner = 0; corner < 3; corner++) {
+                const uint32_t v = triangle[corner];
+                output.push_back(v);
+
+                // drop the triangle from the vertex's remaining list
+                uint32_t *first = &adjacency[firstTriangle[v]];
+                uint32_t *last = first + remaining[v];
+                *std::find(first, last, (uint32_t) best) = *(last - 1);
+                remaining[v]--;
+            }
+
+            // the triangle's vertices move to the front, everything else shifts back
+            nextCache.assign(triangle, triangle + 3);
+            for (uint32_t v : cache) {
+                if (v != triangle[0] && v != triangle[1] && v != triangle[2]) nextCache.push_back(v);
+            }
+            for (size_t i = 0; i < nextCache.size(); i++) {
+                const uint32_t v = nextCache[i];
+                cachePosition[v] = i < (size_t) CACHE_SIZE ? (int) i : -1;
+                score[v] = vertexScore(cachePosition[v], remaining[v]);
+            }
+
+            // rescore every triangle touching the cache and pick the best
+            best = -1;
+            float bestScore = -1.0f;
+            for (uint32_t v : nextCache) {
+                for (uint32_t i = 0; i < remaining[v]; i++) {
+                    const uint32_t t = adjacency[firstTriangle[v] + i];
+                    triangleScore[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+                    if (cachePosition[v] >= 0 && triangleScore[t] > bestScore) {
+                        bestScore = triangleScore[t];
+                        best = t;
+                    }
+                }
+            }
+
+            if (nextCache.size() > (size_t) CACHE_SIZE) nextCache.resize(CACHE_SIZE);
+            cache.swap(nextCache);
+        }
+
+        indices.swap(output);
+    }
+
+    // optimizeVertexFetch() ///////////////////////////////////////////////////
+    //
+    //  Renumbers vertices in the order the index buffer first touches them,
+    //      dropping any that no triangle uses.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void optimizeVertexFetch(std::vector<Vertex> &vertices, std::vector<uint32_t> &indices) {
+        const uint32_t UNUSED = 0xFFFFFFFFu;
+        std::vector<uint32_t> remap(vertices.size(), UNUSED);
+        std::vector<Vertex> ordered;
+        ordered.reserve(vertices.size());
+        for (uint32_t &index : indices) {
+            if (remap[index] == UNUSED) {
+                remap[index] = (uint32_t) ordered.size();
+                ordered.push_back(vertices[index]);
+            }
+            index = remap[index];
+        }
+        vertices.swap(ordered);
+    }
+
+    // simplify() //////////////////////////////////////////////////////////////
+    //
+    //  Vertex clustering: snaps every vertex to a grid of cellSize, merging
+    //      those in the same cell that face roughly the same way (one of six
+    //      axis directions, so creases survive) into their average.  Triangles
+    //      that collapse are dropped.  The geometric error is about cellSize.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void simplify(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices, float cellSize,
+                         std::vector<Vertex> &outVertices, std::vector<uint32_t> &outIndices) {
+        auto clusterKey = [cellSize](const Vertex &vertex) {
+            const glm::vec3 n = vertex.normal;
+            const glm::vec3 a = glm::abs(n);
+            const int axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+            const uint64_t direction = (uint64_t) (axis * 2 + (n[axis] < 0.0f ? 1 : 0));
+
+            uint64_t key = direction;
+            for (int i = 0; i < 3; i++) {
+                // 20 bits per axis is a million cells either way, far beyond any model
+                const int64_t cell = (int64_t) std::floor(vertex.position[i] / cellSize) + (1 << 19);
+                key = (key << 20) | ((uint64_t) std::clamp<int64_t>(cell, 0, (1 << 20) - 1));
+            }
+            return key;
+        };
+
+        std::unordered_map<uint64_t, uint32_t> clusters;
+        std::vector<uint32_t> clusterOf(vertices.size());
+        outVertices.clear();
+        for (size_t i = 0; i < vertices.size(); i++) {
+            auto inserted = clusters.emplace(clusterKey(vertices[i]), (uint32_t) outVertices.size());
+            if (inserted.second) outVertices.push_back({glm::vec3(0.0f), glm::vec3(0.0f)});
+            clusterOf[i] = inserted.first->second;
+        }
+
+        std::vector<uint32_t> members(outVertices.size(), 0);
+        for (size_t i = 0; i < vertices.size(); i++) {
+            Vertex &cluster = outVertices[clusterOf[i]];
+            cluster.position += vertices[i].position;
+            cluster.normal += vertices[i].normal;
+            members[clusterOf[i]]++;
+        }
+        for (size_t c = 0; c < outVertices.size(); c++) {
+            outVertices[c].position /= (float) members[c];
+            const float length = glm::length(outVertices[c].normal);
+            outVertices[c].normal = length > 1e-6f ? outVertices[c].normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+
+        outIndices.clear();
+        for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+            const uint32_t a = clusterOf[indices[t]], b = clusterOf[indices[t + 1]], c = clusterOf[indices[t + 2]];
+            if (a == b || b == c || a == c) continue;
+            outIndices.push_back(a);
+            outIndices.push_back(b);
+            outIndices.push_back(c);
+        }
+    }
+}
+
+#endif //A3_MESHOPTIMIZER_H
@@ -0,0 +1,245 @@
+//
+// Draws imported meshes from MeshLoader.
+//
+// Each draw places one mesh with a model matrix and renders it into every
+// active view with one instanced call (an instance per view, routed to its
+// viewport by the geometry shader), lit like the trees by the sun, the
+// shadow maps and the clustered point lights.  The level of detail is the
+// coarsest whose error, seen from the nearest camera, stays under
+// MAX_ANGULAR_ERROR.
+//
+
+#ifndef A3_MESHRENDERER_H
+#define A3_MESHRENDERER_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+#include "ClusteredLights.h"
+#include "MeshLoader.h"
+#include "MultiView.h"
+#include "ShaderUtils.h"
+#include "ShadowMaps.h"
+
+class MeshRenderer {
+public:
+    // radians; about two pixels of a 1080 line view with a 45 degree field of view
+    static constexpr float MAX_ANGULAR_ERROR = 0.0015f;
+
+    void init() {
+        const std::string fragmentSource = ShaderUtils::joinSources({"#version 410 core\n", ClusteredLights::GLSL_SOURCE,
+                                                                     ShadowMaps::GLSL_SOURCE, FRAGMENT_SHADER});
+        _shaderProgram = ShaderUtils::createProgram(VERTEX_SHADER, fragmentSource.c_str(), GEOMETRY_SHADER);
+        _locations = _getVertexLocations(_shaderProgram);
+        _lightPositionLocation = glGetUniformLocation(_shaderProgram, "lightPosition");
+        _lightColorLocation = glGetUniformLocation(_shaderProgram, "lightColor");
+        _materialColorLocation = glGetUniformLocation(_shaderProgram, "materialColor");
+        _clusterLocations = ClusteredLights::getLocations(_shaderProgram);
+        _shadowLocations = ShadowMaps::getLocations(_shaderProgram);
+
+        // same vertex processing, no shading, for rendering into shadow maps
+        _depthProgram = ShaderUtils::createProgram(VERTEX_SHADER, DEPTH_FRAGMENT_SHADER, GEOMETRY_SHADER);
+        _depthLocations = _getVertexLocations(_depthProgram);
+    }
+
+    // draw() //////////////////////////////////////////////////////////////////
+    //
+    //  Draws mesh placed by model into every view it is visible in.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void draw(const MeshLoader::Mesh &mesh, const glm::mat4 &model, glm::vec3 color, const MultiView &views,
+              const ClusteredLights &lights, const ShadowMaps &shadows, glm::vec3 lightPosition, glm::vec3 lightColor) {
+        const int lod = _selectLod(mesh, model, views);
+        if (lod < 0) return;
+
+        glUseProgram(_shaderProgram);
+        _setVertexUniforms(_locations, mesh, model, views);
+        glUniform3fv(_lightPositionLocation, 1, &lightPosition[0]);
+        glUniform3fv(_lightColorLocation, 1, &lightColor[0]);
+        glUniform3fv(_materialColorLocation, 1, &color[0]);
+        lights.apply(_clusterLocations);
+        shadows.apply(_shadowLocations);
+
+        _drawLod(mesh, lod, views);
+        glUseProgram(0);
+    }
+
+    // drawDepth() /////////////////////////////////////////////////////////////
+    //
+    //  The same draw with depth only output, for shadow maps.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void drawDepth(const MeshLoader::Mesh &mesh, const glm::mat4 &model, const MultiView &views) {
+        const int lod = _selectLod(mesh, model, views);
+        if (lod < 0) return;
+
+        glUseProgram(_depthProgram);
+        _setVertexUniforms(_depthLocations, mesh, model, views);
+        _drawLod(mesh, lod, views);
+        glUseProgram(0);
+    }
+
+    // the level the last draw picked, for the statistics
+    int lastLod() const { return _lastLod; }
+
+private:
+    struct VertexLocations {
+        GLint viewProjection, numViews, modelMatrix, normalMatrix, meshCenter, meshExtent;
+    };
+
+    static VertexLocations _getVertexLocations(GLuint program) {
+        VertexLocations locations;
+        locations.viewProjection = glGetUniformLocation(program, "viewProjection");
+        locations.numViews = glGetUniformLocation(program, "numViews");
+        locations.modelMatrix = glGetUniformLocation(program, "modelMatrix");
+        locations.normalMatrix = glGetUniformLocation(program, "normalMatrix");
+        locations.meshCenter = glGetUniformLocation(program, "meshCenter");
+        locations.meshExtent = glGetUniformLocation(program, "meshExtent");
+        return locations;
+    }
+
+    // largest axis scale of the model matrix, for bounds and errors
+    static float _maxScale(const glm::mat4 &model) {
+        return std::max(std::max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1]))),
+                        glm::length(glm::vec3(model[2])));
+    }
+
+    // -1 if the mesh is outside every view
+    int _selectLod(const MeshLoader::Mesh &mesh, const glm::mat4 &model, const MultiView &views) {
+        const glm::vec3 center = glm::vec3(model * glm::vec4(mesh.center, 1.0f));
+        const float scale = _maxScale(model);
+        if (!views.sphereVisible(center, mesh.radius * scale)) return -1;
+
+        float distance = 1e30f;
+        for (int v = 0; v < views.numViews(); v++) {
+            distance = std::min(distance, glm::distance(views.cameraPosition(v), center) - mesh.radius * scale);
+        }
+        distance = std::max(distance, 1e-3f);
+
+        int lod = 0;
+        while (lod + 1 < mesh.numLods && mesh.lods[lod + 1].error * scale / distance < MAX_ANGULAR_ERROR) lod++;
+        _lastLod = lod;
+        return lod;
+    }
+
+    static void _setVertexUniforms(const VertexLocations &locations, const MeshLoader::Mesh &mesh,
+                                   const glm::mat4 &model, const MultiView &views) {
+        const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+
+        views.setUniforms(locations.viewProjection, locations.numViews);
+        glUniformMatrix4fv(locations.modelMatrix, 1, GL_FALSE, &model[0][0]);
+        glUniformMatrix3fv(locations.normalMatrix, 1, GL_FALSE, &normalMatrix[0][0]);
+        glUniform3fv(locations.meshCenter, 1, &mesh.center[0]);
+        glUniform1f(locations.meshExtent, mesh.extent);
+    }
+
+    static void _drawLod(const MeshLoader::Mesh &mesh, int lod, const MultiView &views) {
+        const MeshLoader::Lod &level = mesh.lods[lod];
+        const size_t indexSize = mesh.indexType == GL_UNSIGNED_SHORT ? sizeof(uint16_t) : sizeof(uint32_t);
+
+        glBindVertexArray(mesh.vao);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, level.numIndices, mesh.indexType,
+                                          (void *) (level.firstIndex * indexSize), views.numViews(),
+                                          level.baseVertex);
+        glBindVertexArray(0);
+    }
+
+    static constexpr const char *VERTEX_SHADER = R"(
+#version 410 core
+uniform mat4 viewProjection[4];
+uniform int numViews;
+uniform mat4 modelMatrix;
+uniform mat3 normalMatrix;
+uniform vec3 meshCenter;
+uniform float meshExtent;
+
+layout(location = 0) in vec3 vPos;          // snorm16, relative to meshCenter
+layout(location = 1) in vec4 vNormal;       // 10:10:10:2
+
+out vec3 vsWorldPosition;
+out vec3 vsWorldNormal;
+flat out int vsViewIndex;
+
+void main() {
+    vsWorldPosition = (modelMatrix * vec4(meshCenter + vPos * meshExtent, 1.0)).xyz;
+    vsWorldNormal = normalize(normalMatrix * vNormal.xyz);
+    vsViewIndex = gl_InstanceID;             // one instance per view
+
+    gl_Position = viewProjection[vsViewIndex] * vec4(vsWorldPosition, 1.0);
+}
+)";
+
+    // routes each triangle to the viewport of the view its instance copy is for
+    static constexpr const char *GEOMETRY_SHADER = R"(
+#version 410 core
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in vec3 vsWorldPosition[];
+in vec3 vsWorldNormal[];
+flat in int vsViewIndex[];
+
+out vec3 worldPosition;
+out vec3 worldNormal;
+flat out int viewIndex;
+
+void main() {
+    for (int i = 0; i < 3; i++) {
+        gl_Position = gl_in[i].gl_Position;
+        gl_ViewportIndex = vsViewIndex[0];
+        worldPosition = vsWorldPosition[i];
+        worldNormal = vsWorldNormal[i];
+        viewIndex = vsViewIndex[0];
+        EmitVertex();
+    }
+    EndPrimitive();
+}
+)";
+
+    // body only; init() prepends the version line and the lighting and shadow GLSL
+    static constexpr const char *FRAGMENT_SHADER = R"(
+uniform vec3 lightPosition;
+uniform vec3 lightColor;
+uniform vec3 materialColor;
+
+in vec3 worldPosition;
+in vec3 worldNormal;
+flat in int viewIndex;
+
+out vec4 fragColorOut;
+
+void main() {
+    vec3 normal = normalize(worldNormal);
+    vec3 lightDirection = normalize(lightPosition - worldPosition);
+    float diffuse = max(dot(normal, lightDirection), 0.0) * shadowVisibility(worldPosition, normal);
+    vec3 color = materialColor * lightColor * (0.2 + 0.8 * diffuse);
+    color += clusteredLighting(worldPosition, normal, materialColor, viewIndex);
+    fragColorOut = vec4(color, 1.0);
+}
+)";
+
+    static constexpr const char *DEPTH_FRAGMENT_SHADER = R"(
+#version 410 core
+void main() {
+}
+)";
+
+    GLuint _shaderProgram = 0;
+    VertexLocations _locations = {};
+    GLint _lightPositionLocation = -1, _lightColorLocation = -1, _materialColorLocation = -1;
+    ClusteredLights::Locations _clusterLocations = {};
+    ShadowMaps::Locations _shadowLocations = {};
+
+    GLuint _depthProgram = 0;
+    VertexLocations _depthLocations = {};
+
+    int _lastLod = 0;
+};
+
+#endif //A3_MESHRENDERER_H
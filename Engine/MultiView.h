@@ -0,0 +1,114 @@
+//
+// Split-screen support.
+//
+// Holds up to MAX_VIEWS cameras with their own viewports.  Instanced passes
+// cull their instances once against the union of every view's frustum and
+// then draw all views in the same call: the instance count is multiplied by
+// the number of views, per-instance attributes advance once every numViews
+// instances, and a pass-through geometry shader routes each copy to its
+// viewport through gl_ViewportIndex.
+//
+
+#ifndef A3_MULTIVIEW_H
+#define A3_MULTIVIEW_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+
+class MultiView {
+public:
+    static const int MAX_VIEWS = 4;
+
+    struct View {
+        glm::mat4 viewMtx;
+        glm::mat4 projMtx;
+        GLint x, y;
+        GLsizei width, height;
+    };
+
+    void setViews(const View *views, int numViews) {
+        _numViews = numViews < 1 ? 1 : (numViews > MAX_VIEWS ? MAX_VIEWS : numViews);
+        for (int i = 0; i < _numViews; i++) {
+            _views[i] = views[i];
+            _viewProjection[i] = views[i].projMtx * views[i].viewMtx;
+            _extractPlanes(_viewProjection[i], _planes[i]);
+        }
+    }
+
+    int numViews() const { return _numViews; }
+    const View &view(int index) const { return _views[index]; }
+    const glm::mat4 &viewProjection(int index) const { return _viewProjection[index]; }
+
+    // world space eye position of a view, recovered from its view matrix
+    glm::vec3 cameraPosition(int index) const {
+        const glm::mat4 inverseView = glm::inverse(_views[index].viewMtx);
+        return glm::vec3(inverseView[3].x, inverseView[3].y, inverseView[3].z);
+    }
+
+    // applyViewports() ////////////////////////////////////////////////////////
+    //
+    //  Loads every view's rectangle into the indexed viewports.  Note that a
+    //      plain glViewport() afterwards resets all of them.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void applyViewports() const {
+        for (int i = 0; i < _numViews; i++) {
+            glViewportIndexedf(i, (GLfloat) _views[i].x, (GLfloat) _views[i].y,
+                               (GLfloat) _views[i].width, (GLfloat) _views[i].height);
+        }
+    }
+
+    // setUniforms() ///////////////////////////////////////////////////////////
+    //
+    //  Uploads the viewProjection[MAX_VIEWS] array and numViews uniforms of a
+    //      multi-view program.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void setUniforms(GLint viewProjectionLocation, GLint numViewsLocation) const {
+        glUniformMatrix4fv(viewProjectionLocation, _numViews, GL_FALSE, &_viewProjection[0][0][0]);
+        glUniform1i(numViewsLocation, _numViews);
+    }
+
+    // sphereVisible() /////////////////////////////////////////////////////////
+    //
+    //  True if the sphere touches at least one view's frustum.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    bool sphereVisible(glm::vec3 center, float radius) const {
+        for (int i = 0; i < _numViews; i++) {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; p++) {
+                const glm::vec4 &plane = _planes[i][p];
+                inside = plane.x * center.x + plane.y * center.y + plane.z * center.z + plane.w >= -radius;
+            }
+            if (inside) return true;
+        }
+        return false;
+    }
+
+private:
+    // Gribb & Hartmann: the frustum planes are sums and differences of the
+    //  rows of the view-projection matrix, normalized so distances are in
+    //  world units
+    static void _extractPlanes(const glm::mat4 &m, glm::vec4 *planes) {
+        for (int axis = 0; axis < 3; axis++) {
+            for (int side = 0; side < 2; side++) {
+                const float sign = side == 0 ? 1.0f : -1.0f;
+                glm::vec4 plane(m[0][3] + sign * m[0][axis], m[1][3] + sign * m[1][axis],
+                                m[2][3] + sign * m[2][axis], m[3][3] + sign * m[3][axis]);
+                const float length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+                planes[axis * 2 + side] = plane / length;
+            }
+        }
+    }
+
+    View _views[MAX_VIEWS] = {};
+    glm::mat4 _viewProjection[MAX_VIEWS];
+    glm::vec4 _planes[MAX_VIEWS][6];
+    int _numViews = 1;
+};
+
+#endif //A3_MULTIVIEW_H
@@ -0,0 +1,258 @@
+//
+// Compact vertex and instance layouts.
+//
+// Mesh vertices store snorm16 positions (relative to a per-mesh extent) and
+// 10:10:10:2 normals, 12 bytes instead of the 24 a pair of glm::vec3 take.
+// Instances store a half float position, a 16-bit yaw, half float
+// horizontal/vertical scale and a palette index, 16 bytes instead of the
+// 76 of a mat4 plus a vec3.  The vertex shader rebuilds the transform.
+// The full precision layouts are kept too, so the same instanced draw can
+// run with either and the two be timed against each other.
+//
+
+#ifndef A3_PACKEDFORMATS_H
+#define A3_PACKEDFORMATS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace PackedFormats {
+
+    // attribute locations shared by every shader that reads these formats
+    const GLuint POSITION_LOCATION = 0;
+    const GLuint NORMAL_LOCATION = 1;
+    const GLuint INSTANCE_POSITION_LOCATION = 2;
+    const GLuint INSTANCE_YAW_LOCATION = 3;
+    const GLuint INSTANCE_SCALE_LOCATION = 4;
+    const GLuint INSTANCE_PALETTE_LOCATION = 5;
+
+    struct PackedVertex {
+        int16_t position[4];             // snorm16, w unused
+        uint32_t normal;                 // GL_INT_2_10_10_10_REV
+    };
+    static_assert(sizeof(PackedVertex) == 12, "PackedVertex must stay 12 bytes");
+
+    struct PackedInstance {
+        uint16_t position[3];            // half float world position
+        uint16_t yaw;                    // unorm16 of [0, 2pi)
+        uint16_t scale[2];               // half float XZ and Y scale
+        uint8_t palette;                 // index into the shader's color palette
+        uint8_t padding[3];
+    };
+    static_assert(sizeof(PackedInstance) == 16, "PackedInstance must stay 16 bytes");
+
+    // the full precision formats the packed ones replace, with their own
+    //  attribute locations: the model matrix takes four, 2 through 5
+    const GLuint FULL_INSTANCE_MODEL_LOCATION = 2;
+    const GLuint FULL_INSTANCE_COLOR_LOCATION = 6;
+
+    struct FullVertex {
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
+
+    struct FullInstance {
+        glm::mat4 model;
+        glm::vec3 color;
+    };
+
+    const size_t FULL_VERTEX_SIZE = sizeof(FullVertex);
+    const size_t FULL_INSTANCE_SIZE = sizeof(FullInstance);
+
+    // packVertex() ////////////////////////////////////////////////////////////
+    //
+    //  Packs a position (which must lie within +/- extent on every axis) and
+    //      a unit normal.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline PackedVertex packVertex(glm::vec3 position, glm::vec3 normal, float extent) {
+        PackedVertex vertex = {};
+        for (int i = 0; i < 3; i++) {
+            vertex.position[i] = (int16_t) glm::packSnorm1x16(position[i] / extent);
+        }
+        vertex.normal = glm::packSnorm3x10_1x2(glm::vec4(normal, 0.0f));
+        return vertex;
+    }
+
+    // packInstance() //////////////////////////////////////////////////////////
+    //
+    //  Packs an instance placed at position, rotated yaw radians about +Y and
+    //      scaled by (scaleXZ, scaleY, scaleXZ).
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline PackedInstance packInstance(glm::vec3 position, float yaw, float scaleXZ, float scaleY, uint8_t palette) {
+        const float TWO_PI = 6.28318530718f;
+        float wrappedYaw = std::fmod(yaw, TWO_PI);
+        if (wrappedYaw < 0.0f) wrappedYaw += TWO_PI;
+
+        PackedInstance instance = {};
+        for (int i = 0; i < 3; i++) {
+            instance.position[i] = glm::packHalf1x16(position[i]);
+        }
+        instance.yaw = glm::packUnorm1x16(wrappedYaw / TWO_PI);
+        instance.scale[0] = glm::packHalf1x16(scaleXZ);
+        instance.scale[1] = glm::packHalf1x16(scaleY);
+        instance.palette = palette;
+        return instance;
+    }
+
+    // fullInstance() //////////////////////////////////////////////////////////
+    //
+    //  The full precision counterpart of packInstance(), with the palette
+    //      entry already looked up.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline FullInstance fullInstance(glm::vec3 position, float yaw, float scaleXZ, float scaleY, glm::vec3 color) {
+        const float c = std::cos(yaw), s = std::sin(yaw);
+        FullInstance instance;
+        instance.model = glm::mat4(1.0f);
+        instance.model[0] = glm::vec4(c * scaleXZ, 0.0f, -s * scaleXZ, 0.0f);
+        instance.model[1] = glm::vec4(0.0f, scaleY, 0.0f, 0.0f);
+        instance.model[2] = glm::vec4(s * scaleXZ, 0.0f, c * scaleXZ, 0.0f);
+        instance.model[3] = glm::vec4(position, 1.0f);
+        instance.color = color;
+        return instance;
+    }
+
+    // setupVertexAttributes() /////////////////////////////////////////////////
+    //
+    //  Describes PackedVertex for the currently bound VAO and array buffer.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void setupVertexAttributes() {
+        glEnableVertexAttribArray(POSITION_LOCATION);
+        glVertexAttribPointer(POSITION_LOCATION, 3, GL_SHORT, GL_TRUE, sizeof(PackedVertex),
+                              (void *) offsetof(PackedVertex, position));
+        glEnableVertexAttribArray(NORMAL_LOCATION);
+        glVertexAttribPointer(NORMAL_LOCATION, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedVertex),
+                              (void *) offsetof(PackedVertex, normal));
+    }
+
+    // setupInstanceAttributes() ///////////////////////////////////////////////
+    //
+    //  Describes PackedInstance, advancing once per instance, for the currently
+    //      bound VAO and array buffer.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void setupInstanceAttributes() {
+        glEnableVertexAttribArray(INSTANCE_POSITION_LOCATION);
+        glVertexAttribPointer(INSTANCE_POSITION_LOCATION, 3, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedInstance),
+                              (void *) offsetof(PackedInstance, position));
+        glVertexAttribDivisor(INSTANCE_POSITION_LOCATION, 1);
+
+        glEnableVertexAttribArray(INSTANCE_YAW_LOCATION);
+        glVertexAttribPointer(INSTANCE_YAW_LOCATION, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedInstance),
+                              (void *) offsetof(PackedInstance, yaw));
+        glVertexAttribDivisor(INSTANCE_YAW_LOCATION, 1);
+
+        glEnableVertexAttribArray(INSTANCE_SCALE_LOCATION);
+        glVertexAttribPointer(INSTANCE_SCALE_LOCATION, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedInstance),
+                              (void *) offsetof(PackedInstance, scale));
+        glVertexAttribDivisor(INSTANCE_SCALE_LOCATION, 1);
+
+        glEnableVertexAttribArray(INSTANCE_PALETTE_LOCATION);
+        glVertexAttribIPointer(INSTANCE_PALETTE_LOCATION, 1, GL_UNSIGNED_BYTE, sizeof(PackedInstance),
+                               (void *) offsetof(PackedInstance, palette));
+        glVertexAttribDivisor(INSTANCE_PALETTE_LOCATION, 1);
+    }
+
+    // setInstanceDivisor() ////////////////////////////////////////////////////
+    //
+    //  Multi-view draws replicate every instance once per view, so instance
+    //      attributes advance every numViews instances instead of every one.
+    //      Expects the VAO to be bound.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void setInstanceDivisor(GLuint numViews) {
+        glVertexAttribDivisor(INSTANCE_POSITION_LOCATION, numViews);
+        glVertexAttribDivisor(INSTANCE_YAW_LOCATION, numViews);
+        glVertexAttribDivisor(INSTANCE_SCALE_LOCATION, numViews);
+        glVertexAttribDivisor(INSTANCE_PALETTE_LOCATION, numViews);
+    }
+
+    // setupFullVertexAttributes() /////////////////////////////////////////////
+    //
+    //  Describes FullVertex for the currently bound VAO and array buffer.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void setupFullVertexAttributes() {
+        glEnableVertexAttribArray(POSITION_LOCATION);
+        glVertexAttribPointer(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(FullVertex),
+                              (void *) offsetof(FullVertex, position));
+        glEnableVertexAttribArray(NORMAL_LOCATION);
+        glVertexAttribPointer(NORMAL_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(FullVertex),
+                              (void *) offsetof(FullVertex, normal));
+    }
+
+    // setupFullInstanceAttributes() ///////////////////////////////////////////
+    //
+    //  Describes FullInstance, advancing once per instance, for the currently
+    //      bound VAO and array buffer.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void setupFullInstanceAttributes() {
+        for (GLuint column = 0; column < 4; column++) {
+            glEnableVertexAttribArray(FULL_INSTANCE_MODEL_LOCATION + column);
+            glVertexAttribPointer(FULL_INSTANCE_MODEL_LOCATION + column, 4, GL_FLOAT, GL_FALSE, sizeof(FullInstance),
+                                  (void *) (offsetof(FullInstance, model) + column * sizeof(glm::vec4)));
+            glVertexAttribDivisor(FULL_INSTANCE_MODEL_LOCATION + column, 1);
+        }
+
+        glEnableVertexAttribArray(FULL_INSTANCE_COLOR_LOCATION);
+        glVertexAttribPointer(FULL_INSTANCE_COLOR_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(FullInstance),
+                              (void *) offsetof(FullInstance, color));
+        glVertexAttribDivisor(FULL_INSTANCE_COLOR_LOCATION, 1);
+    }
+
+    // setFullInstanceDivisor() ////////////////////////////////////////////////
+    //
+    //  setInstanceDivisor() for the FullInstance attributes.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void setFullInstanceDivisor(GLuint numViews) {
+        for (GLuint column = 0; column < 4; column++) {
+            glVertexAttribDivisor(FULL_INSTANCE_MODEL_LOCATION + column, numViews);
+        }
+        glVertexAttribDivisor(FULL_INSTANCE_COLOR_LOCATION, numViews);
+    }
+
+    // buildCube() /////////////////////////////////////////////////////////////
+    //
+    //  A unit cube centered at the origin, matching CSCI441::drawSolidCube(1),
+    //      as 24 vertices and 36 byte indices.  Packed and full precision
+    //      vertices come out in the same order, so the indices fit both.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline void buildCube(std::vector<PackedVertex> &vertices, std::vector<FullVertex> &fullVertices,
+                          std::vector<GLubyte> &indices) {
+        const glm::vec3 normals[6] = {
+                glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0),
+                glm::vec3(0, 1, 0), glm::vec3(0, -1, 0),
+                glm::vec3(0, 0, 1), glm::vec3(0, 0, -1)
+        };
+        for (const glm::vec3 &normal : normals) {
+            // two axes spanning the face, ordered so the face winds counter-clockwise
+            glm::vec3 u = glm::vec3(normal.y, normal.z, normal.x);
+            glm::vec3 v = glm::cross(normal, u);
+
+            const GLubyte base = (GLubyte) vertices.size();
+            const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+            for (const auto &corner : corners) {
+                glm::vec3 position = 0.5f * normal + 0.5f * corner[0] * u + 0.5f * corner[1] * v;
+                vertices.push_back(packVertex(position, normal, 0.5f));
+                fullVertices.push_back({position, normal});
+            }
+            const GLubyte face[6] = {0, 1, 2, 0, 2, 3};
+            for (GLubyte index : face) indices.push_back(base + index);
+        }
+    }
+}
+
+#endif //A3_PACKEDFORMATS_H
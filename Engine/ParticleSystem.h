@@ -0,0 +1,378 @@
+//
+// GPU particles simulated with transform feedback.
+//
+// Every particle lives in one of two ping-pong vertex buffers.  Each frame a
+// vertex shader runs over the whole pool with rasterization off: live
+// particles are integrated and aged, and dead ones may respawn at their
+// emitter, and the results are captured into the other buffer.  Particle i
+// belongs to emitter i % numEmitters, so the whole pool is shared between the
+// emitters in use, and a dead particle respawns with a probability that makes
+// its emitter produce about rate particles per second; the CPU only ever
+// uploads the emitter parameters.  All live particles are drawn as point
+// sprites in one call, which also counts them without waiting on the GPU.
+//
+
+#ifndef A3_PARTICLESYSTEM_H
+#define A3_PARTICLESYSTEM_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "MultiView.h"
+#include "ShaderUtils.h"
+
+class ParticleSystem {
+public:
+    static const GLsizei MAX_PARTICLES = 1 << 20;
+    static const int MAX_EMITTERS = 8;
+
+    struct Emitter {
+        glm::vec3 position;
+        float rate;                      // particles per second, 0 to stop
+        glm::vec3 velocity;              // initial velocity
+        float spread;                    // up to this much speed added in a random direction
+        float lifetime;                  // mean seconds a particle lives
+        float gravity;                   // downwards acceleration, negative to rise
+        float drag;                      // fraction of velocity lost per second
+        float size;                      // world space diameter at birth, doubling by death
+        glm::vec4 color;                 // alpha fades out over the lifetime
+    };
+
+    // init() //////////////////////////////////////////////////////////////////
+    //
+    //  Allocates the two particle buffers for capacity particles, every one
+    //      of them starting out dead.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void init(GLsizei capacity = MAX_PARTICLES) {
+        _capacity = capacity;
+
+        _updateProgram = ShaderUtils::createProgram(UPDATE_VERTEX_SHADER, UPDATE_FRAGMENT_SHADER, nullptr,
+                                                    {"outPositionAge", "outVelocityLifetime"});
+        _deltaTimeLocation = glGetUniformLocation(_updateProgram, "deltaTime");
+        _spawnScaleLocation = glGetUniformLocation(_updateProgram, "spawnScale");
+        _seedLocation = glGetUniformLocation(_updateProgram, "seed");
+        _numEmittersLocation = glGetUniformLocation(_updateProgram, "numEmitters");
+        _positionRateLocation = glGetUniformLocation(_updateProgram, "emitterPositionRate");
+        _velocitySpreadLocation = glGetUniformLocation(_updateProgram, "emitterVelocitySpread");
+        _updateMotionLocation = glGetUniformLocation(_updateProgram, "emitterMotion");
+
+        _renderProgram = ShaderUtils::createProgram(RENDER_VERTEX_SHADER, RENDER_FRAGMENT_SHADER, RENDER_GEOMETRY_SHADER);
+        _viewProjectionLocation = glGetUniformLocation(_renderProgram, "viewProjection");
+        _pointScaleLocation = glGetUniformLocation(_renderProgram, "pointScale");
+        _renderMotionLocation = glGetUniformLocation(_renderProgram, "emitterMotion");
+        _colorLocation = glGetUniformLocation(_renderProgram, "emitterColor");
+        _renderNumEmittersLocation = glGetUniformLocation(_renderProgram, "numEmitters");
+
+        glGenQueries(NUM_COUNT_QUERIES, _countQueries);
+        for (CountQuery &query : _countQueryState) query = {false, 1};
+
+        // zero age and zero lifetime: dead until emitted
+        const std::vector<Particle> dead(_capacity, Particle{});
+
+        glGenVertexArrays(2, _vaos);
+        glGenBuffers(2, _buffers);
+        for (int i = 0; i < 2; i++) {
+            glBindVertexArray(_vaos[i]);
+            glBindBuffer(GL_ARRAY_BUFFER, _buffers[i]);
+            glBufferData(GL_ARRAY_BUFFER, dead.size() * sizeof(Particle), dead.data(), GL_DYNAMIC_COPY);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Particle), (void *) 0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Particle), (void *) (4 * sizeof(GLfloat)));
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        _packEmitters();
+    }
+
+    void shutdown() {
+        glDeleteQueries(NUM_COUNT_QUERIES, _countQueries);
+    }
+
+    // emitter slots; set rate to 0 to switch one off.  Changing the number
+    //  of emitters hands live particles to other emitters, so set it once
+    Emitter &emitter(int index) { return _emitters[index]; }
+    void setNumEmitters(int numEmitters) { _numEmitters = glm::clamp(numEmitters, 0, MAX_EMITTERS); }
+
+    // update() ////////////////////////////////////////////////////////////////
+    //
+    //  Advances every particle by deltaTime seconds on the GPU.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void update(float deltaTime) {
+        _packEmitters();
+
+        glUseProgram(_updateProgram);
+        glUniform1f(_deltaTimeLocation, deltaTime);
+        glUniform1f(_spawnScaleLocation, deltaTime * glm::max(_numEmitters, 1) / (float) _capacity);
+        glUniform1ui(_seedLocation, ++_frame);
+        glUniform1i(_numEmittersLocation, _numEmitters);
+        glUniform4fv(_positionRateLocation, MAX_EMITTERS, &_positionRate[0][0]);
+        glUniform4fv(_velocitySpreadLocation, MAX_EMITTERS, &_velocitySpread[0][0]);
+        glUniform4fv(_updateMotionLocation, MAX_EMITTERS, &_motion[0][0]);
+
+        glEnable(GL_RASTERIZER_DISCARD);
+        glBindVertexArray(_vaos[_current]);
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, _buffers[1 - _current]);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, _capacity);
+        glEndTransformFeedback();
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+        glBindVertexArray(0);
+        glDisable(GL_RASTERIZER_DISCARD);
+
+        glUseProgram(0);
+        _current = 1 - _current;
+    }
+
+    // draw() //////////////////////////////////////////////////////////////////
+    //
+    //  Draws the pool into every view with one call: one instance per view,
+    //      dead particles dropped in the geometry shader.  Blended on top of
+    //      the opaque scene without writing depth.  The points the geometry
+    //      shader emits are counted for liveParticles().
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void draw(const MultiView &views) {
+        glm::mat4 viewProjection[MultiView::MAX_VIEWS];
+        GLfloat pointScale[MultiView::MAX_VIEWS];
+        for (int i = 0; i < views.numViews(); i++) {
+            viewProjection[i] = views.viewProjection(i);
+            // pixels per world unit at a clip w of 1
+            pointScale[i] = views.view(i).projMtx[1][1] * views.view(i).height * 0.5f;
+        }
+
+        glUseProgram(_renderProgram);
+        glUniformMatrix4fv(_viewProjectionLocation, views.numViews(), GL_FALSE, &viewProjection[0][0][0]);
+        glUniform1fv(_pointScaleLocation, views.numViews(), pointScale);
+        glUniform4fv(_renderMotionLocation, MAX_EMITTERS, &_motion[0][0]);
+        glUniform4fv(_colorLocation, MAX_EMITTERS, &_color[0][0]);
+        glUniform1i(_renderNumEmittersLocation, _numEmitters);
+
+        glEnable(GL_PROGRAM_POINT_SIZE);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glDepthMask(GL_FALSE);
+
+        _collectCount();
+        glBeginQuery(GL_PRIMITIVES_GENERATED, _countQueries[_nextCountQuery]);
+        glBindVertexArray(_vaos[_current]);
+        glDrawArraysInstanced(GL_POINTS, 0, _capacity, views.numViews());
+        glBindVertexArray(0);
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        _countQueryState[_nextCountQuery] = {true, views.numViews()};
+        _nextCountQuery = (_nextCountQuery + 1) % NUM_COUNT_QUERIES;
+
+        glDepthMask(GL_TRUE);
+        glDisable(GL_BLEND);
+        glDisable(GL_PROGRAM_POINT_SIZE);
+        glUseProgram(0);
+    }
+
+    GLsizei capacity() const { return _capacity; }
+
+    // live particles as of the most recent draw() whose count has come back
+    GLsizei liveParticles() const { return _liveParticles; }
+
+private:
+    static const int NUM_COUNT_QUERIES = 4;
+
+    struct CountQuery {
+        bool issued;
+        int numViews;                    // every live particle is emitted once per view
+    };
+    struct Particle {
+        GLfloat positionAge[4];          // xyz position, w seconds since birth
+        GLfloat velocityLifetime[4];     // xyz velocity, w seconds it lives; dead once age >= lifetime
+    };
+
+    // reads back the oldest count query if it is ready, like GpuTimer, and
+    //  drops it otherwise rather than wait
+    void _collectCount() {
+        CountQuery &query = _countQueryState[_nextCountQuery];
+        if (!query.issued) return;
+        GLint available = GL_FALSE;
+        glGetQueryObjectiv(_countQueries[_nextCountQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint points = 0;
+            glGetQueryObjectuiv(_countQueries[_nextCountQuery], GL_QUERY_RESULT, &points);
+            _liveParticles = (GLsizei) (points / query.numViews);
+        }
+        query.issued = false;
+    }
+
+    // the emitters as the vec4 arrays the shaders take
+    void _packEmitters() {
+        for (int i = 0; i < MAX_EMITTERS; i++) {
+            const Emitter &e = _emitters[i];
+            const float rate = i < _numEmitters ? e.rate : 0.0f;
+            _positionRate[i] = glm::vec4(e.position, rate);
+            _velocitySpread[i] = glm::vec4(e.velocity, e.spread);
+            _motion[i] = glm::vec4(e.lifetime, e.gravity, e.drag, e.size);
+            _color[i] = e.color;
+        }
+    }
+
+    static constexpr const char *UPDATE_VERTEX_SHADER = R"(
+#version 410 core
+uniform float deltaTime;
+uniform float spawnScale;                    // deltaTime / particles per emitter
+uniform uint seed;
+uniform int numEmitters;
+uniform vec4 emitterPositionRate[8];
+uniform vec4 emitterVelocitySpread[8];
+uniform vec4 emitterMotion[8];               // lifetime, gravity, drag, size
+
+layout(location = 0) in vec4 positionAge;
+layout(location = 1) in vec4 velocityLifetime;
+
+out vec4 outPositionAge;
+out vec4 outVelocityLifetime;
+
+uint hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+float random(inout uint state) {
+    state = hash(state);
+    return float(state) / 4294967295.0;
+}
+
+void main() {
+    int emitter = gl_VertexID % max(numEmitters, 1);
+    vec3 position = positionAge.xyz;
+    float age = positionAge.w;
+    vec3 velocity = velocityLifetime.xyz;
+    float lifetime = velocityLifetime.w;
+    vec4 motion = emitterMotion[emitter];
+
+    uint state = hash(uint(gl_VertexID)) ^ hash(seed * 0x9e3779b9u);
+    if (age < lifetime) {
+        velocity.y -= motion.y * deltaTime;
+        velocity *= max(1.0 - motion.z * deltaTime, 0.0);
+        position += velocity * deltaTime;
+        age += deltaTime;
+    } else if (emitter < numEmitters && random(state) < emitterPositionRate[emitter].w * spawnScale) {
+        vec3 direction = normalize(vec3(random(state), random(state), random(state)) * 2.0 - 1.0 + vec3(1e-4));
+        position = emitterPositionRate[emitter].xyz + direction * 0.3;
+        velocity = emitterVelocitySpread[emitter].xyz + direction * emitterVelocitySpread[emitter].w * random(state);
+        age = 0.0;
+        lifetime = motion.x * (0.5 + random(state));
+    }
+
+    outPositionAge = vec4(position, age);
+    outVelocityLifetime = vec4(velocity, lifetime);
+}
+)";
+
+    // never runs, rasterization is off during the update
+    static constexpr const char *UPDATE_FRAGMENT_SHADER = R"(
+#version 410 core
+void main() {
+}
+)";
+
+    static constexpr const char *RENDER_VERTEX_SHADER = R"(
+#version 410 core
+uniform mat4 viewProjection[4];
+uniform float pointScale[4];
+uniform vec4 emitterMotion[8];               // lifetime, gravity, drag, size
+uniform vec4 emitterColor[8];
+uniform int numEmitters;
+
+layout(location = 0) in vec4 positionAge;
+layout(location = 1) in vec4 velocityLifetime;
+
+out vec4 vsColor;
+out float vsAlive;
+flat out int vsViewIndex;
+
+void main() {
+    int emitter = gl_VertexID % max(numEmitters, 1);
+
+    // the update shader's rule, so never-spawned slots (age = lifetime = 0) stay dead
+    vsViewIndex = gl_InstanceID;
+    vsAlive = positionAge.w < velocityLifetime.w ? 1.0 : 0.0;
+    float t = vsAlive > 0.5 ? positionAge.w / velocityLifetime.w : 1.0;
+    vsColor = emitterColor[emitter] * vec4(1.0, 1.0, 1.0, 1.0 - t);
+
+    gl_Position = viewProjection[vsViewIndex] * vec4(positionAge.xyz, 1.0);
+    gl_PointSize = emitterMotion[emitter].w * (1.0 + t) * pointScale[vsViewIndex] / max(gl_Position.w, 1e-3);
+}
+)";
+
+    // drops dead particles and routes the rest to their view's viewport
+    static constexpr const char *RENDER_GEOMETRY_SHADER = R"(
+#version 410 core
+layout(points) in;
+layout(points, max_vertices = 1) out;
+
+in vec4 vsColor[];
+in float vsAlive[];
+flat in int vsViewIndex[];
+
+out vec4 color;
+
+void main() {
+    if (vsAlive[0] < 0.5) return;
+    gl_Position = gl_in[0].gl_Position;
+    gl_PointSize = gl_in[0].gl_PointSize;
+    gl_ViewportIndex = vsViewIndex[0];
+    color = vsColor[0];
+    EmitVertex();
+    EndPrimitive();
+}
+)";
+
+    static constexpr const char *RENDER_FRAGMENT_SHADER = R"(
+#version 410 core
+in vec4 color;
+out vec4 fragColorOut;
+
+void main() {
+    vec2 offset = gl_PointCoord * 2.0 - 1.0;
+    float falloff = 1.0 - dot(offset, offset);
+    if (falloff <= 0.0) discard;
+    fragColorOut = vec4(color.rgb, color.a * falloff);
+}
+)";
+
+    GLsizei _capacity = 0;
+    Emitter _emitters[MAX_EMITTERS] = {};
+    int _numEmitters = 0;
+    uint32_t _frame = 0;
+
+    glm::vec4 _positionRate[MAX_EMITTERS];
+    glm::vec4 _velocitySpread[MAX_EMITTERS];
+    glm::vec4 _motion[MAX_EMITTERS];
+    glm::vec4 _color[MAX_EMITTERS];
+
+    GLuint _updateProgram = 0;
+    GLint _deltaTimeLocation = -1, _spawnScaleLocation = -1, _seedLocation = -1, _numEmittersLocation = -1;
+    GLint _positionRateLocation = -1, _velocitySpreadLocation = -1, _updateMotionLocation = -1;
+
+    GLuint _renderProgram = 0;
+    GLint _viewProjectionLocation = -1, _pointScaleLocation = -1, _renderMotionLocation = -1, _colorLocation = -1;
+    GLint _renderNumEmittersLocation = -1;
+
+    GLuint _countQueries[NUM_COUNT_QUERIES] = {};
+    CountQuery _countQueryState[NUM_COUNT_QUERIES] = {};
+    int _nextCountQuery = 0;
+    GLsizei _liveParticles = 0;
+
+    GLuint _vaos[2] = {}, _buffers[2] = {};
+    int _current = 0;                    // buffer holding the latest state
+};
+
+#endif //A3_PARTICLESYSTEM_H
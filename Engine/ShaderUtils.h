@@ -0,0 +1,276 @@
+//
+// Small helpers for building our own GLSL programs alongside SimpleShader3.
+//
+// Linked programs are cached on disk with glGetProgramBinary, keyed by a hash
+// of their sources and the driver's vendor, renderer and version strings, so
+// later launches skip compiling.  Anything that fails to load from the cache
+// is rebuilt from source.
+//
+
+#ifndef A3_SHADERUTILS_H
+#define A3_SHADERUTILS_H
+
+#include <GL/glew.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace ShaderUtils {
+
+    // compileShader() /////////////////////////////////////////////////////////
+    //
+    //  Compiles a single shader stage from source.  Prints the info log and
+    //      returns 0 if compilation fails.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline GLuint compileShader(GLenum type, const char *source) {
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 1, &source, nullptr);
+        glCompileShader(shader);
+
+        GLint status = GL_FALSE;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+        if (status != GL_TRUE) {
+            GLint logLength = 0;
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+            std::vector<char> log(logLength > 1 ? logLength : 1, '\0');
+            glGetShaderInfoLog(shader, (GLsizei) log.size(), nullptr, log.data());
+            fprintf(stderr, "[ERROR]: Could not compile shader\n\t%s\n", log.data());
+            glDeleteShader(shader);
+            return 0;
+        }
+        return shader;
+    }
+
+    // linkProgram() ///////////////////////////////////////////////////////////
+    //
+    //  Links an already populated program object.  Prints the info log and
+    //      deletes the program if linking fails.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline GLuint linkProgram(GLuint program) {
+        glLinkProgram(program);
+
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) {
+            GLint logLength = 0;
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+            std::vector<char> log(logLength > 1 ? logLength : 1, '\0');
+            glGetProgramInfoLog(program, (GLsizei) log.size(), nullptr, log.data());
+            fprintf(stderr, "[ERROR]: Could not link shader program\n\t%s\n", log.data());
+            glDeleteProgram(program);
+            return 0;
+        }
+        return program;
+    }
+
+    // joinSources() ///////////////////////////////////////////////////////////
+    //
+    //  Concatenates shader pieces, e.g. a #version line, the shared GLSL of
+    //      ClusteredLights and ShadowMaps, and a shader body without a
+    //      #version line of its own.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline std::string joinSources(std::initializer_list<const char *> parts) {
+        std::string source;
+        for (const char *part : parts) source += part;
+        return source;
+    }
+
+    struct ProgramCacheStats {
+        int hits = 0;
+        int misses = 0;
+        double milliseconds = 0.0;       // total time spent in createProgram()
+    };
+
+    inline ProgramCacheStats &programCacheStats() {
+        static ProgramCacheStats stats;
+        return stats;
+    }
+
+    // where cached binaries are kept; clear it to force a cold start
+    inline std::string &programCacheDirectory() {
+        static std::string directory = "shader_cache";
+        return directory;
+    }
+
+    // programCacheKey() ///////////////////////////////////////////////////////
+    //
+    //  64-bit FNV-1a over the driver identification strings and every source.
+    //      Any driver update or shader edit therefore lands in a new file.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline uint64_t programCacheKey(std::initializer_list<const char *> sources) {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const char *text) {
+            for (const char *c = text ? text : ""; *c; c++) {
+                hash ^= (unsigned char) *c;
+                hash *= 1099511628211ull;
+            }
+            // separator so ("ab", "c") and ("a", "bc") differ
+            hash ^= 0xFF;
+            hash *= 1099511628211ull;
+        };
+        mix((const char *) glGetString(GL_VENDOR));
+        mix((const char *) glGetString(GL_RENDERER));
+        mix((const char *) glGetString(GL_VERSION));
+        for (const char *source : sources) mix(source);
+        return hash;
+    }
+
+    inline std::string programCachePath(uint64_t key) {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) key);
+        return programCacheDirectory() + "/" + name;
+    }
+
+    // loadCachedProgram() /////////////////////////////////////////////////////
+    //
+    //  Returns a linked program from the cache file, or 0 if there is no file
+    //      or the driver rejects the binary.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline GLuint loadCachedProgram(const std::string &path) {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (!file) return 0;
+
+        GLenum format = 0;
+        GLint length = 0;
+        std::vector<unsigned char> binary;
+        bool valid = fread(&format, sizeof(format), 1, file) == 1 &&
+                     fread(&length, sizeof(length), 1, file) == 1 && length > 0;
+        if (valid) {
+            binary.resize(length);
+            valid = fread(binary.data(), 1, binary.size(), file) == binary.size();
+        }
+        fclose(file);
+        if (!valid) return 0;
+
+        GLuint program = glCreateProgram();
+        glProgramBinary(program, format, binary.data(), length);
+
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        if (status != GL_TRUE) {
+            glDeleteProgram(program);
+            return 0;
+        }
+        return program;
+    }
+
+    inline void storeCachedProgram(GLuint program, const std::string &path) {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+
+        GLenum format = 0;
+        std::vector<unsigned char> binary(length);
+        glGetProgramBinary(program, length, &length, &format, binary.data());
+
+        std::error_code error;
+        std::filesystem::create_directories(programCacheDirectory(), error);
+
+        // write to a temporary and rename so a half written binary is never read
+        const std::string tempPath = path + ".tmp";
+        FILE *file = fopen(tempPath.c_str(), "wb");
+        if (!file) return;
+        bool written = fwrite(&format, sizeof(format), 1, file) == 1 &&
+                       fwrite(&length, sizeof(length), 1, file) == 1 &&
+                       fwrite(binary.data(), 1, length, file) == (size_t) length;
+        fclose(file);
+
+        if (written) std::filesystem::rename(tempPath, path, error);
+        if (!written || error) std::filesystem::remove(tempPath, error);
+    }
+
+    // compileProgram() ////////////////////////////////////////////////////////
+    //
+    //  Builds a program from source, asking the driver to keep the binary
+    //      retrievable.  Any feedbackVaryings are captured interleaved, in
+    //      order, by transform feedback.  Returns 0 on failure.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline GLuint compileProgram(const char *vertexSource, const char *fragmentSource,
+                                 const char *geometrySource = nullptr,
+                                 std::initializer_list<const char *> feedbackVaryings = {}) {
+        GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexSource);
+        GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+        GLuint geometryShader = geometrySource ? compileShader(GL_GEOMETRY_SHADER, geometrySource) : 0;
+
+        if (!vertexShader || !fragmentShader || (geometrySource && !geometryShader)) {
+            glDeleteShader(vertexShader);
+            glDeleteShader(fragmentShader);
+            glDeleteShader(geometryShader);
+            return 0;
+        }
+
+        GLuint program = glCreateProgram();
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        if (geometryShader) glAttachShader(program, geometryShader);
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        if (feedbackVaryings.size() > 0) {
+            std::vector<const char *> names(feedbackVaryings);
+            glTransformFeedbackVaryings(program, (GLsizei) names.size(), names.data(), GL_INTERLEAVED_ATTRIBS);
+        }
+
+        program = linkProgram(program);
+
+        // the program keeps the compiled stages alive for as long as it needs them
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        glDeleteShader(geometryShader);
+
+        return program;
+    }
+
+    // createProgram() /////////////////////////////////////////////////////////
+    //
+    //  Builds a program from a vertex and fragment shader (and optionally a
+    //      geometry shader and transform feedback varyings), going through
+    //      the program binary cache when the driver supports any binary
+    //      formats.  Returns 0 on failure.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    inline GLuint createProgram(const char *vertexSource, const char *fragmentSource,
+                                const char *geometrySource = nullptr,
+                                std::initializer_list<const char *> feedbackVaryings = {}) {
+        auto start = std::chrono::steady_clock::now();
+
+        GLint numFormats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+
+        std::string path;
+        GLuint program = 0;
+        if (numFormats > 0) {
+            // the varyings are baked into the binary, so they are part of the key
+            std::string varyings;
+            for (const char *name : feedbackVaryings) varyings += std::string(name) + ";";
+            const uint64_t key = varyings.empty()
+                                 ? programCacheKey({vertexSource, fragmentSource, geometrySource})
+                                 : programCacheKey({vertexSource, fragmentSource, geometrySource, varyings.c_str()});
+            path = programCachePath(key);
+            program = loadCachedProgram(path);
+        }
+
+        ProgramCacheStats &stats = programCacheStats();
+        if (program) {
+            stats.hits++;
+        } else {
+            stats.misses++;
+            program = compileProgram(vertexSource, fragmentSource, geometrySource, feedbackVaryings);
+            if (program && numFormats > 0) storeCachedProgram(program, path);
+        }
+
+        stats.milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return program;
+    }
+}
+
+#endif //A3_SHADERUTILS_H
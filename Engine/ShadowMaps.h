@@ -0,0 +1,220 @@
+//
+// Cached sun shadows with static and dynamic casters kept apart.
+//
+// Two depth maps share one orthographic light projection over the play area.
+// The static map holds the trees and terrain and is only re-rendered when
+// the sun direction changes or invalidateStatic() is called; the dynamic map
+// is cleared and re-rendered every frame with just the moving objects (the
+// car and the heroes), so the per-frame cost follows the number of dynamic
+// casters rather than the size of the world.  Receivers include GLSL_SOURCE
+// and call shadowVisibility(), which takes the darker of the two maps.
+//
+
+#ifndef A3_SHADOWMAPS_H
+#define A3_SHADOWMAPS_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <cstdio>
+
+#include "MultiView.h"
+
+class ShadowMaps {
+public:
+    static const GLsizei STATIC_SIZE = 2048;
+    static const GLsizei DYNAMIC_SIZE = 1024;
+
+    // texture units the maps are bound to; programs must leave them free
+    static const GLint STATIC_UNIT = 3;
+    static const GLint DYNAMIC_UNIT = 4;
+
+    struct Locations {
+        GLint staticMap, dynamicMap, shadowMatrix, normalOffset;
+    };
+
+    // the GLSL every shadow receiving fragment shader includes after its #version line
+    static constexpr const char *GLSL_SOURCE = R"(
+uniform sampler2DShadow staticShadowMap;
+uniform sampler2DShadow dynamicShadowMap;
+uniform mat4 shadowMatrix;                  // world space to [0, 1] shadow map space
+uniform float shadowNormalOffset;           // world units to push receivers along their normal
+
+// four hardware filtered taps from each map; whichever map is darker wins
+float shadowVisibility(vec3 worldPosition, vec3 normal) {
+    vec3 coord = (shadowMatrix * vec4(worldPosition + normal * shadowNormalOffset, 1.0)).xyz;
+    if (any(lessThan(coord, vec3(0.0))) || any(greaterThan(coord, vec3(1.0)))) return 1.0;
+
+    vec2 staticTexel = 1.0 / vec2(textureSize(staticShadowMap, 0));
+    vec2 dynamicTexel = 1.0 / vec2(textureSize(dynamicShadowMap, 0));
+    float visibility = 0.0;
+    for (int i = 0; i < 4; i++) {
+        vec2 tap = vec2(float(i & 1), float(i >> 1)) - 0.5;
+        visibility += min(texture(staticShadowMap, vec3(coord.xy + tap * staticTexel, coord.z)),
+                          texture(dynamicShadowMap, vec3(coord.xy + tap * dynamicTexel, coord.z)));
+    }
+    return visibility * 0.25;
+}
+)";
+
+    // init() //////////////////////////////////////////////////////////////////
+    //
+    //  Creates both depth maps.  The light projection covers a square of
+    //      2 * halfExtent world units around center.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void init(glm::vec3 center, float halfExtent) {
+        _center = center;
+        _halfExtent = halfExtent;
+        _createMap(STATIC_SIZE, _staticTexture, _staticFramebuffer);
+        _createMap(DYNAMIC_SIZE, _dynamicTexture, _dynamicFramebuffer);
+        _staticDirty = true;
+    }
+
+    static Locations getLocations(GLuint program) {
+        Locations locations;
+        locations.staticMap = glGetUniformLocation(program, "staticShadowMap");
+        locations.dynamicMap = glGetUniformLocation(program, "dynamicShadowMap");
+        locations.shadowMatrix = glGetUniformLocation(program, "shadowMatrix");
+        locations.normalOffset = glGetUniformLocation(program, "shadowNormalOffset");
+        return locations;
+    }
+
+    // static casters changed (e.g. the forest was regenerated); re-render next frame
+    void invalidateStatic() { _staticDirty = true; }
+
+    // beginStatic() ///////////////////////////////////////////////////////////
+    //
+    //  Aims the light along lightDirection (pointing towards the sun).  If the
+    //      cached map is still valid returns false and nothing needs drawing;
+    //      otherwise binds and clears the static map and returns true.
+    //      Draw the static casters with lightView() and then call end().
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    bool beginStatic(glm::vec3 lightDirection) {
+        lightDirection = glm::normalize(lightDirection);
+        if (glm::distance(lightDirection, _lightDirection) > 1e-4f) {
+            _lightDirection = lightDirection;
+            _updateLightView();
+            _staticDirty = true;
+        }
+        if (!_staticDirty) return false;
+
+        _staticDirty = false;
+        _staticRenders++;
+        _begin(_staticFramebuffer, STATIC_SIZE);
+        return true;
+    }
+
+    // beginDynamic() //////////////////////////////////////////////////////////
+    //
+    //  Binds and clears the dynamic map.  Draw the moving casters with
+    //      lightView() and then call end().
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void beginDynamic() {
+        _begin(_dynamicFramebuffer, DYNAMIC_SIZE);
+    }
+
+    void end() {
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // the light as a one view MultiView sized for the map being rendered
+    const MultiView &lightView() const { return _lightView; }
+
+    // apply() /////////////////////////////////////////////////////////////////
+    //
+    //  Binds both maps and sets the lookup uniforms for the program
+    //      currently in use.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void apply(const Locations &locations) const {
+        glActiveTexture(GL_TEXTURE0 + STATIC_UNIT);
+        glBindTexture(GL_TEXTURE_2D, _staticTexture);
+        glActiveTexture(GL_TEXTURE0 + DYNAMIC_UNIT);
+        glBindTexture(GL_TEXTURE_2D, _dynamicTexture);
+        glActiveTexture(GL_TEXTURE0);
+
+        // depth -> texture coordinates: [-1, 1] to [0, 1] on every axis
+        const glm::mat4 bias = glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f));
+        const glm::mat4 shadowMatrix = bias * _lightView.viewProjection(0);
+
+        glUniform1i(locations.staticMap, STATIC_UNIT);
+        glUniform1i(locations.dynamicMap, DYNAMIC_UNIT);
+        glUniformMatrix4fv(locations.shadowMatrix, 1, GL_FALSE, &shadowMatrix[0][0]);
+        glUniform1f(locations.normalOffset, 1.5f * 2.0f * _halfExtent / DYNAMIC_SIZE);
+    }
+
+    int staticRenders() const { return _staticRenders; }
+
+private:
+    static void _createMap(GLsizei size, GLuint &texture, GLuint &framebuffer) {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "[ERROR]: Shadow map framebuffer is incomplete\n");
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void _begin(GLuint framebuffer, GLsizei size) {
+        MultiView::View view = _lightView.view(0);
+        view.width = size;
+        view.height = size;
+        _lightView.setViews(&view, 1);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, size, size);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        // slope scaled bias against acne on surfaces facing away from the sun
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2.0f, 4.0f);
+    }
+
+    void _updateLightView() {
+        const float distance = 4.0f * _halfExtent;
+        const glm::vec3 up = std::abs(_lightDirection.y) > 0.99f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+
+        MultiView::View view;
+        view.viewMtx = glm::lookAt(_center + _lightDirection * distance, _center, up);
+        view.projMtx = glm::ortho(-_halfExtent, _halfExtent, -_halfExtent, _halfExtent, 1.0f, 2.0f * distance);
+        view.x = 0;
+        view.y = 0;
+        view.width = STATIC_SIZE;
+        view.height = STATIC_SIZE;
+        _lightView.setViews(&view, 1);
+    }
+
+    glm::vec3 _center = glm::vec3(0.0f);
+    float _halfExtent = 1.0f;
+    glm::vec3 _lightDirection = glm::vec3(0.0f);
+    MultiView _lightView;
+
+    bool _staticDirty = true;
+    int _staticRenders = 0;
+
+    GLuint _staticTexture = 0, _staticFramebuffer = 0;
+    GLuint _dynamicTexture = 0, _dynamicFramebuffer = 0;
+};
+
+#endif //A3_SHADOWMAPS_H
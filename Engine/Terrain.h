@@ -0,0 +1,457 @@
+//
+// Heightmap terrain with continuous distance-based level of detail (CDLOD).
+//
+// The ground is a quadtree of square nodes.  Every frame the tree is walked
+// from the roots and a node is split only while some camera is within the
+// distance range of the next finer level, so the number of patches depends
+// on how much of the screen the terrain covers, not on how big the world
+// is.  Each selected node is one instance of a shared 33x33 vertex grid; the
+// vertex shader samples the (tiling) height texture and morphs vertices
+// towards the next coarser grid as they approach the edge of their range
+// from the nearest camera, so neighboring levels meet without cracks or
+// popping in every view.
+//
+
+#ifndef A3_TERRAIN_H
+#define A3_TERRAIN_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ClusteredLights.h"
+#include "MultiView.h"
+#include "ShaderUtils.h"
+#include "ShadowMaps.h"
+
+class Terrain {
+public:
+    static const int HEIGHTMAP_SIZE = 512;           // texels per side of the tiling height texture
+    static constexpr float HEIGHTMAP_WORLD_SIZE = 1024.0f;
+    static constexpr float HEIGHT_SCALE = 30.0f;
+    static constexpr float WORLD_SIZE = 4096.0f;     // extent of the quadtree, centered on the origin
+
+    // init() //////////////////////////////////////////////////////////////////
+    //
+    //  Generates the height field (kept on the CPU for heightAt()) and the
+    //      GL resources.  Call before placing anything on the ground.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void init() {
+        _generateHeights();
+
+        glGenTextures(1, &_heightTexture);
+        glBindTexture(GL_TEXTURE_2D, _heightTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, HEIGHTMAP_SIZE, HEIGHTMAP_SIZE, 0, GL_RED, GL_FLOAT, _heights.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        const std::string fragmentSource = ShaderUtils::joinSources({"#version 410 core\n", ClusteredLights::GLSL_SOURCE,
+                                                                     ShadowMaps::GLSL_SOURCE, FRAGMENT_SHADER});
+        _shaderProgram = ShaderUtils::createProgram(VERTEX_SHADER, fragmentSource.c_str(), GEOMETRY_SHADER);
+        _vertexLocations = _getVertexLocations(_shaderProgram);
+        _lightPositionLocation = glGetUniformLocation(_shaderProgram, "lightPosition");
+        _lightColorLocation = glGetUniformLocation(_shaderProgram, "lightColor");
+        _colorLocation = glGetUniformLocation(_shaderProgram, "materialColor");
+        _clusterLocations = ClusteredLights::getLocations(_shaderProgram);
+        _shadowLocations = ShadowMaps::getLocations(_shaderProgram);
+
+        // same vertex processing, no shading, for rendering into shadow maps
+        _depthProgram = ShaderUtils::createProgram(VERTEX_SHADER, DEPTH_FRAGMENT_SHADER, GEOMETRY_SHADER);
+        _depthVertexLocations = _getVertexLocations(_depthProgram);
+
+        std::vector<GLfloat> grid;
+        for (int z = 0; z <= GRID_RESOLUTION; z++) {
+            for (int x = 0; x <= GRID_RESOLUTION; x++) {
+                grid.push_back((GLfloat) x / GRID_RESOLUTION);
+                grid.push_back((GLfloat) z / GRID_RESOLUTION);
+            }
+        }
+        std::vector<GLushort> indices;
+        const int row = GRID_RESOLUTION + 1;
+        for (int z = 0; z < GRID_RESOLUTION; z++) {
+            for (int x = 0; x < GRID_RESOLUTION; x++) {
+                const GLushort corner = (GLushort) (z * row + x);
+                const GLushort quad[6] = {corner, (GLushort) (corner + row), (GLushort) (corner + 1),
+                                          (GLushort) (corner + 1), (GLushort) (corner + row), (GLushort) (corner + row + 1)};
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+        _numIndices = (GLsizei) indices.size();
+
+        glGenVertexArrays(1, &_vao);
+        glBindVertexArray(_vao);
+
+        glGenBuffers(1, &_gridBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, _gridBuffer);
+        glBufferData(GL_ARRAY_BUFFER, grid.size() * sizeof(GLfloat), grid.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void *) 0);
+
+        glGenBuffers(1, &_indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+
+        glGenBuffers(1, &_nodeBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, _nodeBuffer);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void *) 0);
+        glVertexAttribDivisor(1, 1);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // sized once here so selection never reallocates it
+        _nodes.reserve(MAX_NODES);
+
+        // each level covers twice the distance of the one below it
+        for (int lod = 0; lod < NUM_LODS; lod++) {
+            _ranges[lod] = LOD0_RANGE * std::pow(2.0f, (float) lod);
+        }
+    }
+
+    // heightAt() //////////////////////////////////////////////////////////////
+    //
+    //  Ground height at a world position; matches what the shader draws.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    float heightAt(float x, float z) const {
+        const float u = x / HEIGHTMAP_WORLD_SIZE * HEIGHTMAP_SIZE - 0.5f;
+        const float v = z / HEIGHTMAP_WORLD_SIZE * HEIGHTMAP_SIZE - 0.5f;
+        const int x0 = (int) std::floor(u), z0 = (int) std::floor(v);
+        const float fx = u - x0, fz = v - z0;
+        const float top = _texel(x0, z0) * (1 - fx) + _texel(x0 + 1, z0) * fx;
+        const float bottom = _texel(x0, z0 + 1) * (1 - fx) + _texel(x0 + 1, z0 + 1) * fx;
+        return (top * (1 - fz) + bottom * fz) * HEIGHT_SCALE * _playAreaMask(x, z);
+    }
+
+    // draw() //////////////////////////////////////////////////////////////////
+    //
+    //  Selects the quadtree nodes for every view at once (a node splits if
+    //      any camera needs the finer level) and draws them in one call, lit
+    //      by the main light plus whatever point lights share each cluster.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void draw(const MultiView &views, const ClusteredLights &lights, const ShadowMaps &shadows,
+              glm::vec3 lightPosition, glm::vec3 lightColor, glm::vec3 color) {
+        glm::vec3 cameras[MultiView::MAX_VIEWS];
+        for (int i = 0; i < views.numViews(); i++) cameras[i] = views.cameraPosition(i);
+        if (!_selectNodes(views, cameras)) return;
+
+        glUseProgram(_shaderProgram);
+        _setVertexUniforms(_vertexLocations, views, cameras);
+        glUniform3fv(_lightPositionLocation, 1, &lightPosition[0]);
+        glUniform3fv(_lightColorLocation, 1, &lightColor[0]);
+        glUniform3fv(_colorLocation, 1, &color[0]);
+        lights.apply(_clusterLocations);
+        shadows.apply(_shadowLocations);
+
+        _drawNodes(views);
+        glUseProgram(0);
+    }
+
+    // drawDepth() /////////////////////////////////////////////////////////////
+    //
+    //  Depth only pass for shadow maps.  The levels are chosen as if every
+    //      view's camera stood at focus rather than at the light, so the
+    //      ground near focus casts with the detail it is drawn with.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void drawDepth(const MultiView &views, glm::vec3 focus) {
+        glm::vec3 cameras[MultiView::MAX_VIEWS];
+        for (int i = 0; i < views.numViews(); i++) cameras[i] = focus;
+        if (!_selectNodes(views, cameras)) return;
+
+        glUseProgram(_depthProgram);
+        _setVertexUniforms(_depthVertexLocations, views, cameras);
+
+        _drawNodes(views);
+        glUseProgram(0);
+    }
+
+    GLsizei numNodes() const { return (GLsizei) _nodes.size(); }
+
+private:
+    static const int GRID_RESOLUTION = 32;           // quads per node side
+    static const int NUM_LODS = 8;
+    static const int MAX_NODES = 4096;               // far more than any set of four cameras selects
+    static constexpr float LOD0_RANGE = 48.0f;
+    static constexpr float MORPH_START = 0.7f;       // fraction of a range where morphing begins
+
+    // uniforms the vertex shader needs, looked up per program
+    struct VertexLocations {
+        GLint viewProjection, numViews, cameraPositions, morphRanges, heightMap;
+    };
+
+    static VertexLocations _getVertexLocations(GLuint program) {
+        VertexLocations locations;
+        locations.viewProjection = glGetUniformLocation(program, "viewProjection");
+        locations.numViews = glGetUniformLocation(program, "numViews");
+        locations.cameraPositions = glGetUniformLocation(program, "cameraPositions");
+        locations.morphRanges = glGetUniformLocation(program, "morphRanges");
+        locations.heightMap = glGetUniformLocation(program, "heightMap");
+        return locations;
+    }
+
+    // walks the quadtree from the four roots into _nodes and streams them;
+    //  false if nothing is visible
+    bool _selectNodes(const MultiView &views, const glm::vec3 *cameras) {
+        _nodes.clear();
+        const float rootSize = WORLD_SIZE / 2;
+        for (int root = 0; root < 4; root++) {
+            glm::vec2 origin(-rootSize + (root % 2) * rootSize, -rootSize + (root / 2) * rootSize);
+            _selectNode(views, cameras, origin, rootSize, NUM_LODS - 1);
+        }
+        if (_nodes.empty()) return false;
+
+        glBindBuffer(GL_ARRAY_BUFFER, _nodeBuffer);
+        glBufferData(GL_ARRAY_BUFFER, _nodes.size() * sizeof(glm::vec4), _nodes.data(), GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return true;
+    }
+
+    void _setVertexUniforms(const VertexLocations &locations, const MultiView &views, const glm::vec3 *cameras) const {
+        glm::vec2 morphRanges[NUM_LODS];
+        for (int lod = 0; lod < NUM_LODS; lod++) {
+            morphRanges[lod] = glm::vec2(_ranges[lod] * MORPH_START, _ranges[lod]);
+        }
+
+        views.setUniforms(locations.viewProjection, locations.numViews);
+        glUniform3fv(locations.cameraPositions, views.numViews(), &cameras[0][0]);
+        glUniform2fv(locations.morphRanges, NUM_LODS, &morphRanges[0][0]);
+        glUniform1i(locations.heightMap, 0);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, _heightTexture);
+    }
+
+    void _drawNodes(const MultiView &views) const {
+        glBindVertexArray(_vao);
+        glVertexAttribDivisor(1, (GLuint) views.numViews());
+        glDrawElementsInstanced(GL_TRIANGLES, _numIndices, GL_UNSIGNED_SHORT, (void *) 0,
+                                (GLsizei) _nodes.size() * views.numViews());
+        glBindVertexArray(0);
+    }
+
+    float _texel(int x, int z) const {
+        x = ((x % HEIGHTMAP_SIZE) + HEIGHTMAP_SIZE) % HEIGHTMAP_SIZE;
+        z = ((z % HEIGHTMAP_SIZE) + HEIGHTMAP_SIZE) % HEIGHTMAP_SIZE;
+        return _heights[(size_t) z * HEIGHTMAP_SIZE + x];
+    }
+
+    // keeps the hills low where we drive around and lets them grow outside it;
+    //  the vertex shader applies the same mask
+    static float _playAreaMask(float x, float z) {
+        const float t = glm::clamp((std::sqrt(x * x + z * z) - 60.0f) / 100.0f, 0.0f, 1.0f);
+        return 0.15f + 0.85f * t * t * (3 - 2 * t);
+    }
+
+    // _generateHeights() //////////////////////////////////////////////////////
+    //
+    //  Tileable fractal value noise in [0, 1]: every octave uses a lattice
+    //      whose period divides the texture so the edges wrap seamlessly.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void _generateHeights() {
+        _heights.assign((size_t) HEIGHTMAP_SIZE * HEIGHTMAP_SIZE, 0.0f);
+
+        auto lattice = [](int x, int z, int period, int octave) {
+            uint32_t h = (uint32_t) (((x % period) + period) % period) * 73856093u ^
+                         (uint32_t) (((z % period) + period) % period) * 19349663u ^ (uint32_t) octave * 83492791u;
+            h ^= h >> 13;
+            h *= 0x5bd1e995u;
+            h ^= h >> 15;
+            return (h & 0xFFFF) / 65535.0f;
+        };
+
+        float amplitude = 0.5f, total = 0.0f;
+        for (int octave = 0, period = 4; octave < 6; octave++, period *= 2) {
+            const float cell = (float) HEIGHTMAP_SIZE / period;
+            for (int z = 0; z < HEIGHTMAP_SIZE; z++) {
+                for (int x = 0; x < HEIGHTMAP_SIZE; x++) {
+                    const int cx = (int) (x / cell), cz = (int) (z / cell);
+                    float fx = x / cell - cx, fz = z / cell - cz;
+                    fx = fx * fx * (3 - 2 * fx);
+                    fz = fz * fz * (3 - 2 * fz);
+                    const float top = lattice(cx, cz, period, octave) * (1 - fx) + lattice(cx + 1, cz, period, octave) * fx;
+                    const float bottom = lattice(cx, cz + 1, period, octave) * (1 - fx) + lattice(cx + 1, cz + 1, period, octave) * fx;
+                    _heights[(size_t) z * HEIGHTMAP_SIZE + x] += amplitude * (top * (1 - fz) + bottom * fz);
+                }
+            }
+            total += amplitude;
+            amplitude *= 0.5f;
+        }
+        for (float &height : _heights) height /= total;
+    }
+
+    // _selectNode() ///////////////////////////////////////////////////////////
+    //
+    //  Standard CDLOD selection.  A node outside every frustum is dropped.  A
+    //      node no camera is within the next finer range of is drawn whole;
+    //      otherwise all four children are selected one level down.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void _selectNode(const MultiView &views, const glm::vec3 *cameras, glm::vec2 origin, float size, int lod) {
+        const glm::vec3 lo(origin.x, 0.0f, origin.y), hi(origin.x + size, HEIGHT_SCALE, origin.y + size);
+        const glm::vec3 center = (lo + hi) * 0.5f;
+        if (!views.sphereVisible(center, glm::length(hi - lo) * 0.5f)) return;
+
+        bool split = false;
+        if (lod > 0) {
+            for (int i = 0; i < views.numViews() && !split; i++) {
+                const glm::vec3 nearest = glm::clamp(cameras[i], lo, hi);
+                split = glm::distance(nearest, cameras[i]) < _ranges[lod - 1];
+            }
+        }
+
+        if (!split) {
+            if (_nodes.size() >= MAX_NODES) return;
+            _nodes.push_back(glm::vec4(origin.x, origin.y, size, (float) lod));
+            return;
+        }
+        const float half = size / 2;
+        _selectNode(views, cameras, origin, half, lod - 1);
+        _selectNode(views, cameras, origin + glm::vec2(half, 0), half, lod - 1);
+        _selectNode(views, cameras, origin + glm::vec2(0, half), half, lod - 1);
+        _selectNode(views, cameras, origin + glm::vec2(half, half), half, lod - 1);
+    }
+
+    static constexpr const char *VERTEX_SHADER = R"(
+#version 410 core
+uniform mat4 viewProjection[4];
+uniform int numViews;
+uniform vec3 cameraPositions[4];
+uniform vec2 morphRanges[8];                 // start / end of each level's morph
+uniform sampler2D heightMap;
+
+layout(location = 0) in vec2 vGrid;          // [0, 1] across the node
+layout(location = 1) in vec4 iNode;          // origin x / z, size, level
+
+out vec3 vsWorldPosition;
+out vec3 vsWorldNormal;
+flat out int vsViewIndex;
+
+const float GRID_RESOLUTION = 32.0;
+const float HEIGHTMAP_WORLD_SIZE = 1024.0;
+const float HEIGHT_SCALE = 30.0;
+
+float playAreaMask(vec2 world) {
+    return 0.15 + 0.85 * smoothstep(60.0, 160.0, length(world));
+}
+
+float heightAt(vec2 world) {
+    return textureLod(heightMap, world / HEIGHTMAP_WORLD_SIZE, 0.0).r * HEIGHT_SCALE * playAreaMask(world);
+}
+
+void main() {
+    vsViewIndex = gl_InstanceID % numViews;
+
+    // distance on the unmorphed grid decides how far to morph towards the
+    //  next coarser level, which drops every other vertex.  It is measured to
+    //  the nearest camera, as selection does, so every view morphs a vertex
+    //  the same way and neighboring levels still meet
+    vec2 world = iNode.xy + vGrid * iNode.z;
+    vec3 unmorphed = vec3(world.x, heightAt(world), world.y);
+    float distanceToCamera = distance(cameraPositions[0], unmorphed);
+    for (int i = 1; i < numViews; i++) {
+        distanceToCamera = min(distanceToCamera, distance(cameraPositions[i], unmorphed));
+    }
+    vec2 range = morphRanges[int(iNode.w)];
+    float morph = clamp((distanceToCamera - range.x) / (range.y - range.x), 0.0, 1.0);
+
+    vec2 odd = fract(vGrid * GRID_RESOLUTION * 0.5) * 2.0 / GRID_RESOLUTION;
+    world = iNode.xy + (vGrid - odd * morph) * iNode.z;
+
+    // normal from central differences one vertex spacing apart
+    float spacing = iNode.z / GRID_RESOLUTION;
+    float left = heightAt(world - vec2(spacing, 0.0)), right = heightAt(world + vec2(spacing, 0.0));
+    float back = heightAt(world - vec2(0.0, spacing)), front = heightAt(world + vec2(0.0, spacing));
+
+    vsWorldPosition = vec3(world.x, heightAt(world), world.y);
+    vsWorldNormal = normalize(vec3(left - right, 2.0 * spacing, back - front));
+    gl_Position = viewProjection[vsViewIndex] * vec4(vsWorldPosition, 1.0);
+}
+)";
+
+    static constexpr const char *GEOMETRY_SHADER = R"(
+#version 410 core
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in vec3 vsWorldPosition[];
+in vec3 vsWorldNormal[];
+flat in int vsViewIndex[];
+
+out vec3 worldPosition;
+out vec3 worldNormal;
+flat out int viewIndex;
+
+void main() {
+    for (int i = 0; i < 3; i++) {
+        gl_Position = gl_in[i].gl_Position;
+        gl_ViewportIndex = vsViewIndex[0];
+        worldPosition = vsWorldPosition[i];
+        worldNormal = vsWorldNormal[i];
+        viewIndex = vsViewIndex[0];
+        EmitVertex();
+    }
+    EndPrimitive();
+}
+)";
+
+    // body only; init() prepends the version line and the lighting and shadow GLSL
+    static constexpr const char *FRAGMENT_SHADER = R"(
+uniform vec3 lightPosition;
+uniform vec3 lightColor;
+uniform vec3 materialColor;
+
+in vec3 worldPosition;
+in vec3 worldNormal;
+flat in int viewIndex;
+
+out vec4 fragColorOut;
+
+void main() {
+    vec3 normal = normalize(worldNormal);
+    vec3 lightDirection = normalize(lightPosition - worldPosition);
+    float diffuse = max(dot(normal, lightDirection), 0.0) * shadowVisibility(worldPosition, normal);
+    vec3 color = materialColor * lightColor * (0.3 + 0.7 * diffuse);
+    color += clusteredLighting(worldPosition, normal, materialColor, viewIndex);
+    fragColorOut = vec4(color, 1.0);
+}
+)";
+
+    static constexpr const char *DEPTH_FRAGMENT_SHADER = R"(
+#version 410 core
+void main() {
+}
+)";
+
+    std::vector<float> _heights;
+    float _ranges[NUM_LODS] = {};
+
+    GLuint _heightTexture = 0;
+    GLuint _shaderProgram = 0;
+    VertexLocations _vertexLocations = {};
+    GLint _lightPositionLocation = -1, _lightColorLocation = -1, _colorLocation = -1;
+    ClusteredLights::Locations _clusterLocations = {};
+    ShadowMaps::Locations _shadowLocations = {};
+
+    GLuint _depthProgram = 0;
+    VertexLocations _depthVertexLocations = {};
+
+    GLuint _vao = 0, _gridBuffer = 0, _indexBuffer = 0, _nodeBuffer = 0;
+    GLsizei _numIndices = 0;
+
+    std::vector<glm::vec4> _nodes;   // origin x / z, size, level; refilled every draw(), reserved by init()
+};
+
+#endif //A3_TERRAIN_H
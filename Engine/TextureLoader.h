@@ -0,0 +1,547 @@
+//
+// Asynchronous texture loading.
+//
+// Images are decoded and mipmapped on worker threads, optionally block
+// compressed (DXT1), and written to a "<image>.mipcache" file beside the
+// source so later launches skip decoding entirely.  The main thread only
+// streams finished mip levels into textures through a small ring of pixel
+// buffer objects, a budgeted amount per frame, and never waits on the GPU.
+// Until a texture has data, getTexture() hands back a placeholder.  The
+// per-texture records live in an ObjectPool sized in init(), so handles
+// stay valid and requesting a texture never grows a container.
+//
+
+#ifndef A3_TEXTURELOADER_H
+#define A3_TEXTURELOADER_H
+
+#include <GL/glew.h>
+
+#include <stb_image.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Allocators.h"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+class TextureLoader {
+public:
+    typedef size_t Handle;
+    static const Handle NO_TEXTURE = (Handle) -1;
+
+    static const size_t MAX_TEXTURES = 64;
+
+    // init() //////////////////////////////////////////////////////////////////
+    //
+    //  Creates the placeholder texture and PBO ring and starts the workers.
+    //      Must be called with the OpenGL context current.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void init(unsigned int numWorkers = 2, size_t uploadBudgetBytes = 1 << 20) {
+        _uploadBudget = uploadBudgetBytes;
+        _compress = GLEW_EXT_texture_compression_s3tc;
+        _entryPool.init(MAX_TEXTURES);
+        _entries.clear();
+        _entries.reserve(MAX_TEXTURES);
+
+        // a small grey checkerboard so unloaded meshes are obviously untextured
+        const unsigned char checker[] = {160, 160, 160, 255,  96,  96,  96, 255,
+                                          96,  96,  96, 255, 160, 160, 160, 255};
+        glGenTextures(1, &_placeholder);
+        glBindTexture(GL_TEXTURE_2D, _placeholder);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, checker);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+        glGenBuffers(NUM_PBOS, _pbos);
+        for (GLsync &fence : _fences) fence = nullptr;
+
+        stbi_set_flip_vertically_on_load(true);
+
+        _stop = false;
+        for (unsigned int i = 0; i < numWorkers; i++) {
+            _workers.emplace_back(&TextureLoader::_workerLoop, this);
+        }
+    }
+
+    // shutdown() //////////////////////////////////////////////////////////////
+    //
+    //  Stops the workers and releases every GL object the loader owns.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _jobReady.notify_all();
+        for (std::thread &worker : _workers) worker.join();
+        _workers.clear();
+
+        for (GLsync &fence : _fences) {
+            if (fence) glDeleteSync(fence);
+            fence = nullptr;
+        }
+        glDeleteBuffers(NUM_PBOS, _pbos);
+        for (Entry *entry : _entries) {
+            if (entry->texture) glDeleteTextures(1, &entry->texture);
+            _entryPool.release(entry);
+        }
+        _entries.clear();
+        _entryPool.clear();
+        glDeleteTextures(1, &_placeholder);
+    }
+
+    // request() ///////////////////////////////////////////////////////////////
+    //
+    //  Queues an image for loading and returns a handle to it immediately,
+    //      or NO_TEXTURE once MAX_TEXTURES have been requested.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    Handle request(const std::string &path) {
+        Entry *entry = _entryPool.acquire();
+        if (!entry) {
+            fprintf(stderr, "[ERROR]: Texture limit of %zu reached, not loading \"%s\"\n", MAX_TEXTURES, path.c_str());
+            return NO_TEXTURE;
+        }
+        *entry = Entry();
+        Handle handle = _entries.size();
+        _entries.push_back(entry);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobs.push_back({handle, path, _compress});
+        }
+        _jobReady.notify_one();
+
+        return handle;
+    }
+
+    // getTexture() ////////////////////////////////////////////////////////////
+    //
+    //  Returns the texture to bind for a handle; the placeholder until at
+    //      least the coarsest mip level of the real image is resident.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    GLuint getTexture(Handle handle) const {
+        if (handle == NO_TEXTURE) return _placeholder;
+        const Entry &entry = *_entries.at(handle);
+        return entry.visible ? entry.texture : _placeholder;
+    }
+
+    bool isReady(Handle handle) const { return handle != NO_TEXTURE && _entries.at(handle)->complete; }
+
+    // update() ////////////////////////////////////////////////////////////////
+    //
+    //  Called once per frame on the main thread.  Picks up images the workers
+    //      have finished and streams their mip levels, coarsest first, through
+    //      the PBO ring.  If the next PBO is still in use by the GPU we simply
+    //      try again next frame rather than block.  Returns true while images
+    //      are still streaming in.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    bool update() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            while (!_finished.empty()) {
+                _pending.push_back(std::move(_finished.front()));
+                _finished.pop_front();
+            }
+        }
+        if (_pending.empty()) return false;
+
+        GLsync &fence = _fences[_nextPbo];
+        if (fence) {
+            if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) return true;
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+
+        // gather as many levels as fit in the budget, but always at least one
+        size_t levelsLeft = 0;
+        for (const Image &image : _pending) levelsLeft += (size_t) (image.nextLevel + 1);
+        FrameArray<UploadSlice> slices(frameArena(), levelsLeft);
+        size_t bytes = 0;
+        for (Image &image : _pending) {
+            while (image.nextLevel >= 0) {
+                const MipLevel &level = image.levels[image.nextLevel];
+                if (!slices.empty() && bytes + level.size > _uploadBudget) break;
+                slices.push_back({&image, image.nextLevel, bytes});
+                bytes += level.size;
+                image.nextLevel--;
+            }
+            if (image.nextLevel >= 0) break;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbos[_nextPbo]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        auto *mapped = (unsigned char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (!mapped) {
+            // put the levels back and retry next frame
+            for (UploadSlice &slice : slices) slice.image->nextLevel = std::max(slice.image->nextLevel, slice.level);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return true;
+        }
+        for (UploadSlice &slice : slices) {
+            const MipLevel &level = slice.image->levels[slice.level];
+            memcpy(mapped + slice.pboOffset, slice.image->data.data() + level.offset, level.size);
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (UploadSlice &slice : slices) {
+            Image &image = *slice.image;
+            Entry &entry = *_entries.at(image.handle);
+            const MipLevel &level = image.levels[slice.level];
+
+            if (!entry.texture) _allocateTexture(entry, image);
+
+            glBindTexture(GL_TEXTURE_2D, entry.texture);
+            if (image.compressed) {
+                glCompressedTexSubImage2D(GL_TEXTURE_2D, slice.level, 0, 0, level.width, level.height,
+                                          GL_COMPRESSED_RGB_S3TC_DXT1_EXT, (GLsizei) level.size,
+                                          (const void *) slice.pboOffset);
+            } else {
+                glTexSubImage2D(GL_TEXTURE_2D, slice.level, 0, 0, level.width, level.height,
+                                GL_RGBA, GL_UNSIGNED_BYTE, (const void *) slice.pboOffset);
+            }
+
+            // let the sampler use everything from this level down
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, slice.level);
+            entry.visible = true;
+            entry.complete = slice.level == 0;
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        _nextPbo = (_nextPbo + 1) % NUM_PBOS;
+
+        while (!_pending.empty() && _pending.front().nextLevel < 0) _pending.pop_front();
+        return true;
+    }
+
+private:
+    static const int NUM_PBOS = 3;
+    static const uint32_t CACHE_MAGIC = 0x4350494D;    // "MIPC"
+    static const uint32_t CACHE_VERSION = 1;
+    static const uint32_t MAX_CACHE_LEVELS = 32;         // a full chain for up to 2^31 texels a side
+
+    struct Entry {
+        GLuint texture = 0;
+        bool visible = false;
+        bool complete = false;
+    };
+
+    struct Job {
+        Handle handle;
+        std::string path;
+        bool compress;
+    };
+
+    struct MipLevel {
+        int32_t width, height;
+        uint64_t offset, size;
+    };
+
+    struct Image {
+        Handle handle;
+        bool compressed;
+        std::vector<MipLevel> levels;
+        std::vector<unsigned char> data;
+        int nextLevel;                  // next level to upload, counting down to 0
+    };
+
+    struct UploadSlice {
+        Image *image;
+        int level;
+        size_t pboOffset;
+    };
+
+    struct CacheHeader {
+        uint32_t magic, version;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        uint32_t compressed, numLevels;
+    };
+
+    void _allocateTexture(Entry &entry, const Image &image) {
+        glGenTextures(1, &entry.texture);
+        glBindTexture(GL_TEXTURE_2D, entry.texture);
+        for (size_t i = 0; i < image.levels.size(); i++) {
+            const MipLevel &level = image.levels[i];
+            if (image.compressed) {
+                glCompressedTexImage2D(GL_TEXTURE_2D, (GLint) i, GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+                                       level.width, level.height, 0, (GLsizei) level.size, nullptr);
+            } else {
+                glTexImage2D(GL_TEXTURE_2D, (GLint) i, GL_RGBA8, level.width, level.height, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            }
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint) image.levels.size() - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    }
+
+    void _workerLoop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _jobReady.wait(lock, [this] { return _stop || !_jobs.empty(); });
+                if (_stop) return;
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+
+            Image image;
+            image.handle = job.handle;
+            if (!_loadImage(job, image)) continue;
+            image.nextLevel = (int) image.levels.size() - 1;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finished.push_back(std::move(image));
+        }
+    }
+
+    static bool _sourceStamp(const std::string &path, uint64_t &size, int64_t &time) {
+        std::error_code error;
+        size = std::filesystem::file_size(path, error);
+        if (error) return false;
+        time = (int64_t) std::filesystem::last_write_time(path, error).time_since_epoch().count();
+        return !error;
+    }
+
+    static bool _loadImage(const Job &job, Image &image) {
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        if (!_sourceStamp(job.path, sourceSize, sourceTime)) {
+            fprintf(stderr, "[ERROR]: Could not find texture \"%s\"\n", job.path.c_str());
+            return false;
+        }
+
+        const std::string cachePath = job.path + ".mipcache";
+        if (_readCache(cachePath, sourceSize, sourceTime, job.compress, image)) return true;
+
+        int width, height, channels;
+        stbi_uc *pixels = stbi_load(job.path.c_str(), &width, &height, &channels, 4);
+        if (!pixels) {
+            fprintf(stderr, "[ERROR]: Could not decode texture \"%s\"\n\t%s\n", job.path.c_str(),
+                    stbi_failure_reason());
+            return false;
+        }
+        std::vector<unsigned char> rgba(pixels, pixels + (size_t) width * height * 4);
+        stbi_image_free(pixels);
+
+        image.compressed = job.compress;
+        while (true) {
+            MipLevel level = {width, height, image.data.size(), 0};
+            if (image.compressed) {
+                _compressDXT1(rgba, width, height, image.data);
+            } else {
+                image.data.insert(image.data.end(), rgba.begin(), rgba.end());
+            }
+            level.size = image.data.size() - level.offset;
+            image.levels.push_back(level);
+
+            if (width == 1 && height == 1) break;
+            rgba = _downsample(rgba, width, height);
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+
+        _writeCache(cachePath, sourceSize, sourceTime, image);
+        return true;
+    }
+
+    // _downsample() ///////////////////////////////////////////////////////////
+    //
+    //  2x2 box filter to produce the next mip level, clamping at odd edges.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    static std::vector<unsigned char> _downsample(const std::vector<unsigned char> &src, int width, int height) {
+        const int newWidth = std::max(1, width / 2), newHeight = std::max(1, height / 2);
+        std::vector<unsigned char> dst((size_t) newWidth * newHeight * 4);
+        for (int y = 0; y < newHeight; y++) {
+            const int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+            for (int x = 0; x < newWidth; x++) {
+                const int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                for (int c = 0; c < 4; c++) {
+                    int sum = src[((size_t) y0 * width + x0) * 4 + c] + src[((size_t) y0 * width + x1) * 4 + c] +
+                              src[((size_t) y1 * width + x0) * 4 + c] + src[((size_t) y1 * width + x1) * 4 + c];
+                    dst[((size_t) y * newWidth + x) * 4 + c] = (unsigned char) ((sum + 2) / 4);
+                }
+            }
+        }
+        return dst;
+    }
+
+    static uint16_t _packRGB565(const unsigned char *rgb) {
+        return (uint16_t) (((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3));
+    }
+
+    static void _unpackRGB565(uint16_t packed, int *rgb) {
+        rgb[0] = ((packed >> 11) & 31) * 255 / 31;
+        rgb[1] = ((packed >> 5) & 63) * 255 / 63;
+        rgb[2] = (packed & 31) * 255 / 31;
+    }
+
+    // _compressDXT1() /////////////////////////////////////////////////////////
+    //
+    //  Bounding box DXT1 encoder.  Quality is modest but it is fast enough to
+    //      run on the workers and cuts texture memory and upload size 8x.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    static void _compressDXT1(const std::vector<unsigned char> &rgba, int width, int height,
+                              std::vector<unsigned char> &out) {
+        for (int by = 0; by < height; by += 4) {
+            for (int bx = 0; bx < width; bx += 4) {
+                unsigned char block[16][3];
+                unsigned char lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+                for (int i = 0; i < 16; i++) {
+                    const int x = std::min(bx + i % 4, width - 1), y = std::min(by + i / 4, height - 1);
+                    for (int c = 0; c < 3; c++) {
+                        block[i][c] = rgba[((size_t) y * width + x) * 4 + c];
+                        lo[c] = std::min(lo[c], block[i][c]);
+                        hi[c] = std::max(hi[c], block[i][c]);
+                    }
+                }
+
+                uint16_t color0 = _packRGB565(hi), color1 = _packRGB565(lo);
+                uint32_t indices = 0;
+                if (color0 != color1) {
+                    // color0 > color1 selects the four color mode
+                    if (color0 < color1) std::swap(color0, color1);
+                    int palette[4][3];
+                    _unpackRGB565(color0, palette[0]);
+                    _unpackRGB565(color1, palette[1]);
+                    for (int c = 0; c < 3; c++) {
+                        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+                    }
+                    for (int i = 0; i < 16; i++) {
+                        int best = 0, bestError = 1 << 30;
+                        for (int p = 0; p < 4; p++) {
+                            int error = 0;
+                            for (int c = 0; c < 3; c++) {
+                                const int d = block[i][c] - palette[p][c];
+                                error += d * d;
+                            }
+                            if (error < bestError) { best = p; bestError = error; }
+                        }
+                        indices |= (uint32_t) best << (2 * i);
+                    }
+                }
+
+                const unsigned char encoded[8] = {
+                        (unsigned char) (color0 & 0xFF), (unsigned char) (color0 >> 8),
+                        (unsigned char) (color1 & 0xFF), (unsigned char) (color1 >> 8),
+                        (unsigned char) (indices & 0xFF), (unsigned char) ((indices >> 8) & 0xFF),
+                        (unsigned char) ((indices >> 16) & 0xFF), (unsigned char) (indices >> 24)};
+                out.insert(out.end(), encoded, encoded + 8);
+            }
+        }
+    }
+
+    // the cache is a header, the level table and then every level back to back,
+    //  so loading it is one read straight into the image's data block.  The
+    //  table is checked against the file size before anything is allocated,
+    //  so a truncated or corrupt cache is just a miss
+    static bool _readCache(const std::string &cachePath, uint64_t sourceSize, int64_t sourceTime,
+                           bool compressed, Image &image) {
+        std::error_code error;
+        const uintmax_t fileSize = std::filesystem::file_size(cachePath, error);
+        if (error || fileSize < sizeof(CacheHeader)) return false;
+
+        FILE *file = fopen(cachePath.c_str(), "rb");
+        if (!file) return false;
+
+        CacheHeader header = {};
+        bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+                     header.magic == CACHE_MAGIC && header.version == CACHE_VERSION &&
+                     header.sourceSize == sourceSize && header.sourceTime == sourceTime &&
+                     (header.compressed != 0) == compressed &&
+                     header.numLevels > 0 && header.numLevels <= MAX_CACHE_LEVELS &&
+                     sizeof(CacheHeader) + header.numLevels * sizeof(MipLevel) <= fileSize;
+        if (valid) {
+            image.levels.resize(header.numLevels);
+            valid = fread(image.levels.data(), sizeof(MipLevel), header.numLevels, file) == header.numLevels;
+        }
+
+        const uint64_t dataSize = valid ? fileSize - sizeof(CacheHeader) - header.numLevels * sizeof(MipLevel) : 0;
+        for (size_t i = 0; valid && i < image.levels.size(); i++) {
+            const MipLevel &level = image.levels[i];
+            valid = level.width > 0 && level.height > 0 &&
+                    level.offset <= dataSize && level.size <= dataSize - level.offset;
+        }
+        if (valid) {
+            image.data.resize((size_t) dataSize);
+            valid = fread(image.data.data(), 1, image.data.size(), file) == image.data.size();
+        }
+        fclose(file);
+
+        image.compressed = compressed;
+        if (!valid) {
+            image.levels.clear();
+            image.data.clear();
+        }
+        return valid;
+    }
+
+    static void _writeCache(const std::string &cachePath, uint64_t sourceSize, int64_t sourceTime,
+                            const Image &image) {
+        // write to a temporary and rename so a half written cache is never read
+        const std::string tempPath = cachePath + ".tmp";
+        FILE *file = fopen(tempPath.c_str(), "wb");
+        if (!file) return;
+
+        CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, sourceSize, sourceTime,
+                              image.compressed ? 1u : 0u, (uint32_t) image.levels.size()};
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(image.levels.data(), sizeof(MipLevel), image.levels.size(), file) == image.levels.size() &&
+                       fwrite(image.data.data(), 1, image.data.size(), file) == image.data.size();
+        fclose(file);
+
+        std::error_code error;
+        if (written) std::filesystem::rename(tempPath, cachePath, error);
+        if (!written || error) std::filesystem::remove(tempPath, error);
+    }
+
+    GLuint _placeholder = 0;
+    GLuint _pbos[NUM_PBOS] = {};
+    GLsync _fences[NUM_PBOS] = {};
+    int _nextPbo = 0;
+    size_t _uploadBudget = 0;
+    bool _compress = false;
+
+    ObjectPool<Entry> _entryPool;        // main thread only
+    std::vector<Entry *> _entries;       // by handle, reserved for MAX_TEXTURES
+    std::deque<Image> _pending;          // main thread only
+
+    std::mutex _mutex;                   // guards everything below
+    std::condition_variable _jobReady;
+    std::deque<Job> _jobs;
+    std::deque<Image> _finished;
+    bool _stop = false;
+
+    std::vector<std::thread> _workers;
+};
+
+#endif //A3_TEXTURELOADER_H
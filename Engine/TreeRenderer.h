@@ -0,0 +1,404 @@
+//
+// Draws every tree cube (trunks and leaf layers) in one instanced call using
+// the packed formats from PackedFormats.h.  Cubes are culled once per frame
+// against all active views and the survivors drawn into every view at once.
+// The same draw can run with the full precision formats instead, so the
+// saving from packing can be timed apart from the one from instancing.
+//
+
+#ifndef A3_TREERENDERER_H
+#define A3_TREERENDERER_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "ClusteredLights.h"
+#include "MultiView.h"
+#include "PackedFormats.h"
+#include "ShaderUtils.h"
+#include "ShadowMaps.h"
+
+class TreeRenderer {
+public:
+    // palette indices available to addCube()
+    enum Palette : uint8_t {
+        TRUNK_BROWN = 0,
+        LEAF_GREEN = 1
+    };
+
+    // attribute layouts the same instanced draw can run with, to time them
+    //  against each other
+    enum Format {
+        PACKED_FORMAT = 0,               // PackedVertex and PackedInstance
+        FULL_FORMAT = 1                  // FullVertex and FullInstance
+    };
+
+    void init() {
+        const std::string fragmentSource = ShaderUtils::joinSources({"#version 410 core\n", ClusteredLights::GLSL_SOURCE,
+                                                                     ShadowMaps::GLSL_SOURCE, FRAGMENT_SHADER});
+        const char *vertexShaders[2] = {PACKED_VERTEX_SHADER, FULL_VERTEX_SHADER};
+        for (int format = PACKED_FORMAT; format <= FULL_FORMAT; format++) {
+            _programs[format] = ShaderUtils::createProgram(vertexShaders[format], fragmentSource.c_str(),
+                                                           GEOMETRY_SHADER);
+            _locations[format] = _getLocations(_programs[format]);
+
+            // same vertex processing, no shading, for rendering into shadow maps
+            _depthPrograms[format] = ShaderUtils::createProgram(vertexShaders[format], DEPTH_FRAGMENT_SHADER,
+                                                                GEOMETRY_SHADER);
+            _depthLocations[format] = _getLocations(_depthPrograms[format]);
+        }
+
+        std::vector<PackedFormats::PackedVertex> vertices;
+        std::vector<PackedFormats::FullVertex> fullVertices;
+        std::vector<GLubyte> indices;
+        PackedFormats::buildCube(vertices, fullVertices, indices);
+        _numVertices = (GLsizei) vertices.size();
+        _numIndices = (GLsizei) indices.size();
+
+        glGenVertexArrays(2, _vaos);
+        glGenBuffers(2, _vertexBuffers);
+        glGenBuffers(2, _instanceBuffers);
+        glGenBuffers(1, &_indexBuffer);
+
+        glBindVertexArray(_vaos[PACKED_FORMAT]);
+        glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffers[PACKED_FORMAT]);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(PackedFormats::PackedVertex), vertices.data(),
+                     GL_STATIC_DRAW);
+        PackedFormats::setupVertexAttributes();
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size(), indices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffers[PACKED_FORMAT]);
+        PackedFormats::setupInstanceAttributes();
+
+        // the full format shares the index buffer, since the cubes match vertex for vertex
+        glBindVertexArray(_vaos[FULL_FORMAT]);
+        glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffers[FULL_FORMAT]);
+        glBufferData(GL_ARRAY_BUFFER, fullVertices.size() * sizeof(PackedFormats::FullVertex), fullVertices.data(),
+                     GL_STATIC_DRAW);
+        PackedFormats::setupFullVertexAttributes();
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffers[FULL_FORMAT]);
+        PackedFormats::setupFullInstanceAttributes();
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // addCube() ///////////////////////////////////////////////////////////////
+    //
+    //  Adds a unit cube centered at position and scaled by (scaleXZ, scaleY,
+    //      scaleXZ).  Call upload() once every cube has been added.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void addCube(glm::vec3 position, float scaleXZ, float scaleY, Palette palette) {
+        _instances.push_back(PackedFormats::packInstance(position, 0.0f, scaleXZ, scaleY, palette));
+        _fullInstances.push_back(PackedFormats::fullInstance(position, 0.0f, scaleXZ, scaleY, _paletteColor(palette)));
+
+        // bounding sphere of the scaled unit cube
+        const float radius = 0.5f * std::sqrt(2 * scaleXZ * scaleXZ + scaleY * scaleY);
+        _bounds.push_back(glm::vec4(position, radius));
+    }
+
+    void upload() {
+        // sized once here so culling never reallocates them
+        _visible.clear();
+        _visible.reserve(_instances.size());
+        _visibleFull.clear();
+        _visibleFull.reserve(_fullInstances.size());
+
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffers[PACKED_FORMAT]);
+        glBufferData(GL_ARRAY_BUFFER, _instances.size() * sizeof(PackedFormats::PackedInstance), nullptr,
+                     GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffers[FULL_FORMAT]);
+        glBufferData(GL_ARRAY_BUFFER, _fullInstances.size() * sizeof(PackedFormats::FullInstance), nullptr,
+                     GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // the format draw() and drawDepth() use from now on
+    void setFormat(Format format) { _format = format; }
+    Format format() const { return _format; }
+
+    // draw() //////////////////////////////////////////////////////////////////
+    //
+    //  Culls against the union of the views' frusta, streams the visible
+    //      instances and draws them into every view with one call.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void draw(const MultiView &views, const ClusteredLights &lights, const ShadowMaps &shadows,
+              glm::vec3 lightPosition, glm::vec3 lightColor) {
+        if (!_cullAndStream(views)) return;
+
+        const glm::vec3 palette[2] = {_paletteColor(TRUNK_BROWN), _paletteColor(LEAF_GREEN)};
+        const Locations &locations = _locations[_format];
+
+        glUseProgram(_programs[_format]);
+        views.setUniforms(locations.viewProjection, locations.numViews);
+        glUniform1f(locations.extent, 0.5f);
+        glUniform3fv(locations.lightPosition, 1, &lightPosition[0]);
+        glUniform3fv(locations.lightColor, 1, &lightColor[0]);
+        glUniform3fv(locations.palette, 2, &palette[0][0]);
+        lights.apply(locations.clusters);
+        shadows.apply(locations.shadows);
+
+        _drawVisible();
+        glUseProgram(0);
+    }
+
+    // drawDepth() /////////////////////////////////////////////////////////////
+    //
+    //  The same culled, instanced draw with depth only output, for shadow
+    //      maps.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void drawDepth(const MultiView &views) {
+        if (!_cullAndStream(views)) return;
+
+        const Locations &locations = _depthLocations[_format];
+        glUseProgram(_depthPrograms[_format]);
+        views.setUniforms(locations.viewProjection, locations.numViews);
+        glUniform1f(locations.extent, 0.5f);
+
+        _drawVisible();
+        glUseProgram(0);
+    }
+
+    GLsizei numInstances() const { return (GLsizei) _instances.size(); }
+    GLsizei numVisible() const { return _numVisible; }
+
+    // attribute bytes pulled by one draw, split by stream
+    struct AttributeBytes {
+        size_t vertices, indices, instances;
+        size_t total() const { return vertices + indices + instances; }
+    };
+
+    // estimateBytesPerFrame() /////////////////////////////////////////////////
+    //
+    //  Estimated attribute bytes the last draw() would pull in format: every
+    //      vertex of the cube and every index once per visible instance per
+    //      view (ignoring the post-transform cache) plus the instance
+    //      records.  Both formats share the cube's GLubyte indices, so only
+    //      the vertex and instance streams differ.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    AttributeBytes estimateBytesPerFrame(Format format) const {
+        const bool full = format == FULL_FORMAT;
+        const size_t vertexSize = full ? PackedFormats::FULL_VERTEX_SIZE : sizeof(PackedFormats::PackedVertex);
+        const size_t instanceSize = full ? PackedFormats::FULL_INSTANCE_SIZE : sizeof(PackedFormats::PackedInstance);
+        const size_t draws = (size_t) _numVisible * _numViews;
+        return {draws * _numVertices * vertexSize, draws * _numIndices * sizeof(GLubyte), draws * instanceSize};
+    }
+
+private:
+    // uniforms looked up per program; the full format has no extent or palette
+    struct Locations {
+        GLint viewProjection, numViews, extent, lightPosition, lightColor, palette;
+        ClusteredLights::Locations clusters;
+        ShadowMaps::Locations shadows;
+    };
+
+    static Locations _getLocations(GLuint program) {
+        Locations locations;
+        locations.viewProjection = glGetUniformLocation(program, "viewProjection");
+        locations.numViews = glGetUniformLocation(program, "numViews");
+        locations.extent = glGetUniformLocation(program, "meshExtent");
+        locations.lightPosition = glGetUniformLocation(program, "lightPosition");
+        locations.lightColor = glGetUniformLocation(program, "lightColor");
+        locations.palette = glGetUniformLocation(program, "palette");
+        locations.clusters = ClusteredLights::getLocations(program);
+        locations.shadows = ShadowMaps::getLocations(program);
+        return locations;
+    }
+
+    static glm::vec3 _paletteColor(Palette palette) {
+        return palette == TRUNK_BROWN ? glm::vec3(0.38f, 0.2f, 0.07f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+
+    // copies the instances inside any view into visible and streams them
+    //  to buffer, sized for all of them
+    template<typename Instance>
+    static void _cull(const MultiView &views, const std::vector<glm::vec4> &bounds,
+                      const std::vector<Instance> &instances, std::vector<Instance> &visible, GLuint buffer) {
+        visible.clear();
+        for (size_t i = 0; i < instances.size(); i++) {
+            if (views.sphereVisible(glm::vec3(bounds[i].x, bounds[i].y, bounds[i].z), bounds[i].w)) {
+                visible.push_back(instances[i]);
+            }
+        }
+        if (visible.empty()) return;
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, visible.size() * sizeof(Instance), visible.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // culls and streams the instances of the current format; false if
+    //  nothing is visible
+    bool _cullAndStream(const MultiView &views) {
+        if (_format == FULL_FORMAT) {
+            _cull(views, _bounds, _fullInstances, _visibleFull, _instanceBuffers[FULL_FORMAT]);
+            _numVisible = (GLsizei) _visibleFull.size();
+        } else {
+            _cull(views, _bounds, _instances, _visible, _instanceBuffers[PACKED_FORMAT]);
+            _numVisible = (GLsizei) _visible.size();
+        }
+        _numViews = views.numViews();
+        return _numVisible > 0;
+    }
+
+    void _drawVisible() const {
+        glBindVertexArray(_vaos[_format]);
+        if (_format == FULL_FORMAT) {
+            PackedFormats::setFullInstanceDivisor(_numViews);
+        } else {
+            PackedFormats::setInstanceDivisor(_numViews);
+        }
+        glDrawElementsInstanced(GL_TRIANGLES, _numIndices, GL_UNSIGNED_BYTE, (void *) 0, _numVisible * _numViews);
+        glBindVertexArray(0);
+    }
+
+    static constexpr const char *PACKED_VERTEX_SHADER = R"(
+#version 410 core
+uniform mat4 viewProjection[4];
+uniform int numViews;
+uniform float meshExtent;
+uniform vec3 palette[2];
+
+layout(location = 0) in vec3 vPos;          // snorm16
+layout(location = 1) in vec4 vNormal;       // 10:10:10:2
+layout(location = 2) in vec3 iPosition;     // half floats
+layout(location = 3) in float iYaw;         // unorm16 fraction of a turn
+layout(location = 4) in vec2 iScale;        // half floats, XZ and Y
+layout(location = 5) in uint iPalette;
+
+out vec3 vsWorldPosition;
+out vec3 vsWorldNormal;
+out vec3 vsMaterialColor;
+flat out int vsViewIndex;
+
+void main() {
+    float angle = iYaw * 6.28318530718;
+    float c = cos(angle), s = sin(angle);
+    mat3 rotation = mat3(c, 0.0, -s,  0.0, 1.0, 0.0,  s, 0.0, c);
+    vec3 scale = vec3(iScale.x, iScale.y, iScale.x);
+
+    vsWorldPosition = iPosition + rotation * (vPos * meshExtent * scale);
+    vsWorldNormal = normalize(rotation * (vNormal.xyz / scale));
+    vsMaterialColor = palette[iPalette];
+    vsViewIndex = gl_InstanceID % numViews;
+
+    gl_Position = viewProjection[vsViewIndex] * vec4(vsWorldPosition, 1.0);
+}
+)";
+
+    // the same transform from a full mat4 and float attributes
+    static constexpr const char *FULL_VERTEX_SHADER = R"(
+#version 410 core
+uniform mat4 viewProjection[4];
+uniform int numViews;
+
+layout(location = 0) in vec3 vPos;
+layout(location = 1) in vec3 vNormal;
+layout(location = 2) in mat4 iModel;        // locations 2 to 5
+layout(location = 6) in vec3 iColor;
+
+out vec3 vsWorldPosition;
+out vec3 vsWorldNormal;
+out vec3 vsMaterialColor;
+flat out int vsViewIndex;
+
+void main() {
+    // the model is translate * rotate * scale, so dividing the normal by the
+    //  squared scale gives the inverse transpose without inverting anything
+    vec3 scale = vec3(length(iModel[0].xyz), length(iModel[1].xyz), length(iModel[2].xyz));
+
+    vsWorldPosition = (iModel * vec4(vPos, 1.0)).xyz;
+    vsWorldNormal = normalize(mat3(iModel) * (vNormal / (scale * scale)));
+    vsMaterialColor = iColor;
+    vsViewIndex = gl_InstanceID % numViews;
+
+    gl_Position = viewProjection[vsViewIndex] * vec4(vsWorldPosition, 1.0);
+}
+)";
+
+    // routes each triangle to the viewport of the view its instance copy is for
+    static constexpr const char *GEOMETRY_SHADER = R"(
+#version 410 core
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in vec3 vsWorldPosition[];
+in vec3 vsWorldNormal[];
+in vec3 vsMaterialColor[];
+flat in int vsViewIndex[];
+
+out vec3 worldPosition;
+out vec3 worldNormal;
+out vec3 materialColor;
+flat out int viewIndex;
+
+void main() {
+    for (int i = 0; i < 3; i++) {
+        gl_Position = gl_in[i].gl_Position;
+        gl_ViewportIndex = vsViewIndex[0];
+        worldPosition = vsWorldPosition[i];
+        worldNormal = vsWorldNormal[i];
+        materialColor = vsMaterialColor[i];
+        viewIndex = vsViewIndex[0];
+        EmitVertex();
+    }
+    EndPrimitive();
+}
+)";
+
+    // body only; init() prepends the version line and the lighting and shadow GLSL
+    static constexpr const char *FRAGMENT_SHADER = R"(
+uniform vec3 lightPosition;
+uniform vec3 lightColor;
+
+in vec3 worldPosition;
+in vec3 worldNormal;
+in vec3 materialColor;
+flat in int viewIndex;
+
+out vec4 fragColorOut;
+
+void main() {
+    vec3 normal = normalize(worldNormal);
+    vec3 lightDirection = normalize(lightPosition - worldPosition);
+    float diffuse = max(dot(normal, lightDirection), 0.0) * shadowVisibility(worldPosition, normal);
+    vec3 color = materialColor * lightColor * (0.2 + 0.8 * diffuse);
+    color += clusteredLighting(worldPosition, normal, materialColor, viewIndex);
+    fragColorOut = vec4(color, 1.0);
+}
+)";
+
+    static constexpr const char *DEPTH_FRAGMENT_SHADER = R"(
+#version 410 core
+void main() {
+}
+)";
+
+    GLuint _programs[2] = {}, _depthPrograms[2] = {};
+    Locations _locations[2] = {}, _depthLocations[2] = {};
+
+    Format _format = PACKED_FORMAT;
+    GLuint _vaos[2] = {}, _vertexBuffers[2] = {}, _instanceBuffers[2] = {}, _indexBuffer = 0;
+    GLsizei _numVertices = 0, _numIndices = 0;
+    GLsizei _numViews = 1;
+    GLsizei _numVisible = 0;
+
+    std::vector<PackedFormats::PackedInstance> _instances;
+    std::vector<PackedFormats::FullInstance> _fullInstances;
+    std::vector<glm::vec4> _bounds;                          // xyz center, w radius
+    std::vector<PackedFormats::PackedInstance> _visible;     // refilled every draw(), reserved by upload()
+    std::vector<PackedFormats::FullInstance> _visibleFull;
+};
+
+#endif //A3_TREERENDERER_H
@@ -0,0 +1,367 @@
+//
+// Instanced crowds of TriangleMan.
+//
+// MyClass::draw_triangleman() builds the character from three triangles and a
+// cube with a push/pop and a material change for each piece.  Here those
+// pieces, placed and colored as MyClass places them, are baked into one
+// vertex-colored mesh and every TriangleMan is a 16 byte instance (position,
+// facing, animation phase).  The bob that MyClass drives from the CPU with
+// up/upsome is evaluated in the vertex shader, so the whole crowd is one draw
+// call and no per-frame CPU work.
+//
+// The crowd is bucketed into square cells at upload.  Each frame the cells
+// are culled against every active view, the surviving ranges are copied on
+// the GPU into the draw buffer, and that one buffer is drawn into all views.
+//
+
+#ifndef A3_TRIANGLEMANCROWD_H
+#define A3_TRIANGLEMANCROWD_H
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "../Engine/MultiView.h"
+#include "../Engine/ShaderUtils.h"
+
+class TriangleManCrowd {
+public:
+    struct CrowdInstance {
+        float position[3];
+        uint16_t facing;                 // unorm16 fraction of a turn, MyClass::thata
+        uint16_t phase;                  // unorm16 offset into the bob cycle
+    };
+    static_assert(sizeof(CrowdInstance) == 16, "CrowdInstance must stay 16 bytes");
+
+    void init(GLsizei maxInstances) {
+        _shaderProgram = ShaderUtils::createProgram(VERTEX_SHADER, FRAGMENT_SHADER, GEOMETRY_SHADER);
+        _viewProjectionLocation = glGetUniformLocation(_shaderProgram, "viewProjection");
+        _numViewsLocation = glGetUniformLocation(_shaderProgram, "numViews");
+        _timeLocation = glGetUniformLocation(_shaderProgram, "time");
+
+        std::vector<CrowdVertex> vertices;
+        _buildMesh(vertices);
+        _numVertices = (GLsizei) vertices.size();
+
+        glGenVertexArrays(1, &_vao);
+        glBindVertexArray(_vao);
+
+        glGenBuffers(1, &_vertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(CrowdVertex), vertices.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(CrowdVertex), (void *) offsetof(CrowdVertex, position));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(CrowdVertex), (void *) offsetof(CrowdVertex, color));
+
+        _instances.resize(maxInstances);
+        glGenBuffers(1, &_sourceBuffer);
+        glBindBuffer(GL_COPY_READ_BUFFER, _sourceBuffer);
+        glBufferData(GL_COPY_READ_BUFFER, _instances.size() * sizeof(CrowdInstance), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        glGenBuffers(1, &_instanceBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceBuffer);
+        glBufferData(GL_ARRAY_BUFFER, _instances.size() * sizeof(CrowdInstance), nullptr, GL_DYNAMIC_DRAW);
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(CrowdInstance), (void *) offsetof(CrowdInstance, position));
+        glVertexAttribDivisor(2, 1);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CrowdInstance), (void *) offsetof(CrowdInstance, facing));
+        glVertexAttribDivisor(3, 1);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // setInstance() ///////////////////////////////////////////////////////////
+    //
+    //  Places TriangleMan number index.  facing is in radians like
+    //      MyClass::thata and phase is in [0, 1).  upload() reorders the crowd
+    //      into cells, so after it only instance 0 may be moved.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void setInstance(GLsizei index, glm::vec3 position, float facing, float phase) {
+        const float TWO_PI = 6.28318530718f;
+        float wrappedFacing = std::fmod(facing, TWO_PI);
+        if (wrappedFacing < 0.0f) wrappedFacing += TWO_PI;
+
+        CrowdInstance &instance = _instances.at(index);
+        instance.position[0] = position.x;
+        instance.position[1] = position.y;
+        instance.position[2] = position.z;
+        instance.facing = glm::packUnorm1x16(wrappedFacing / TWO_PI);
+        instance.phase = glm::packUnorm1x16(phase - std::floor(phase));
+    }
+
+    // upload() / uploadInstance() /////////////////////////////////////////////
+    //
+    //  upload() buckets the crowd into cells and sends it once after
+    //      placement; uploadInstance() refreshes instance 0, the player
+    //      controlled TriangleMan, which lives in a cell of its own.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void upload() {
+        auto cellOf = [](const CrowdInstance &instance) {
+            return std::make_pair((int) std::floor(instance.position[2] / CELL_SIZE),
+                                  (int) std::floor(instance.position[0] / CELL_SIZE));
+        };
+        std::sort(_instances.begin() + 1, _instances.end(),
+                  [&cellOf](const CrowdInstance &a, const CrowdInstance &b) { return cellOf(a) < cellOf(b); });
+
+        _cells.clear();
+        _cells.push_back({0, 1, glm::vec4(0.0f)});
+        for (GLsizei i = 1; i < (GLsizei) _instances.size(); i++) {
+            if (i == 1 || cellOf(_instances[i]) != cellOf(_instances[i - 1])) {
+                _cells.push_back({i, 0, glm::vec4(0.0f)});
+            }
+            _cells.back().count++;
+        }
+        for (size_t c = 1; c < _cells.size(); c++) {
+            Cell &cell = _cells[c];
+            glm::vec3 lo(1e30f), hi(-1e30f);
+            for (GLsizei i = cell.first; i < cell.first + cell.count; i++) {
+                const glm::vec3 position(_instances[i].position[0], _instances[i].position[1], _instances[i].position[2]);
+                lo = glm::min(lo, position);
+                hi = glm::max(hi, position);
+            }
+            cell.bounds = glm::vec4((lo + hi) * 0.5f, glm::length(hi - lo) * 0.5f + CHARACTER_RADIUS);
+        }
+
+        glBindBuffer(GL_COPY_READ_BUFFER, _sourceBuffer);
+        glBufferSubData(GL_COPY_READ_BUFFER, 0, _instances.size() * sizeof(CrowdInstance), _instances.data());
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    }
+
+    void uploadInstance(GLsizei index) {
+        glBindBuffer(GL_COPY_READ_BUFFER, _sourceBuffer);
+        glBufferSubData(GL_COPY_READ_BUFFER, index * sizeof(CrowdInstance), sizeof(CrowdInstance), &_instances.at(index));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+        if (index == 0 && !_cells.empty()) {
+            const CrowdInstance &hero = _instances[0];
+            _cells[0].bounds = glm::vec4(hero.position[0], hero.position[1], hero.position[2], CHARACTER_RADIUS);
+        }
+    }
+
+    // draw() //////////////////////////////////////////////////////////////////
+    //
+    //  Culls the cells against the union of the views' frusta, gathers the
+    //      visible ranges into the draw buffer with GPU side copies (runs of
+    //      neighboring cells are merged into one copy) and draws every view.
+    //      includeHero false leaves out instance 0, for when the player's
+    //      TriangleMan is drawn some other way.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void draw(const MultiView &views, float time, bool includeHero = true) {
+        glBindBuffer(GL_COPY_READ_BUFFER, _sourceBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, _instanceBuffer);
+
+        _numVisible = 0;
+        GLsizei runFirst = 0, runCount = 0;
+        for (size_t c = includeHero ? 0 : 1; c < _cells.size(); c++) {
+            const Cell &cell = _cells[c];
+            if (!views.sphereVisible(glm::vec3(cell.bounds.x, cell.bounds.y, cell.bounds.z), cell.bounds.w)) continue;
+            if (runCount > 0 && runFirst + runCount == cell.first) {
+                runCount += cell.count;
+                continue;
+            }
+            _copyRange(runFirst, runCount);
+            runFirst = cell.first;
+            runCount = cell.count;
+        }
+        _copyRange(runFirst, runCount);
+
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        _drawVisible(views, time);
+    }
+
+    // drawHero() //////////////////////////////////////////////////////////////
+    //
+    //  Draws only instance 0, the player controlled TriangleMan; used for the
+    //      per-frame shadow pass where the rest of the crowd is not wanted.
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    void drawHero(const MultiView &views, float time) {
+        glBindBuffer(GL_COPY_READ_BUFFER, _sourceBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, _instanceBuffer);
+        _numVisible = 0;
+        _copyRange(0, 1);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        _drawVisible(views, time);
+    }
+
+    GLsizei numInstances() const { return (GLsizei) _instances.size(); }
+    GLsizei numVisible() const { return _numVisible; }
+
+private:
+    // draws the first _numVisible instances of the draw buffer into every view
+    void _drawVisible(const MultiView &views, float time) const {
+        if (_numVisible == 0) return;
+
+        const GLuint numViews = (GLuint) views.numViews();
+
+        glUseProgram(_shaderProgram);
+        views.setUniforms(_viewProjectionLocation, _numViewsLocation);
+        glUniform1f(_timeLocation, time);
+
+        glBindVertexArray(_vao);
+        glVertexAttribDivisor(2, numViews);
+        glVertexAttribDivisor(3, numViews);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, _numVertices, _numVisible * (GLsizei) numViews);
+        glBindVertexArray(0);
+
+        glUseProgram(0);
+    }
+
+    static constexpr float CELL_SIZE = 64.0f;
+    static constexpr float CHARACTER_RADIUS = 8.0f;  // covers the triangles and the bob
+
+    struct Cell {
+        GLsizei first, count;
+        glm::vec4 bounds;                // xyz center, w radius
+    };
+
+    // appends instances [first, first + count) of the source buffer to the
+    //  draw buffer; both are expected to be bound to the copy targets
+    void _copyRange(GLsizei first, GLsizei count) {
+        if (count == 0) return;
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, first * sizeof(CrowdInstance),
+                            _numVisible * sizeof(CrowdInstance), count * sizeof(CrowdInstance));
+        _numVisible += count;
+    }
+
+    struct CrowdVertex {
+        float position[3];
+        uint8_t color[3];
+        uint8_t bob;                     // 255 for the piece that bobs, read as color.a
+    };
+
+    static void _addTriangle(std::vector<CrowdVertex> &vertices, glm::vec3 offset, const uint8_t *color, bool bobs) {
+        // a new stand-in: MyClass draws whatever triangleVAO it is handed and
+        // nothing in the tree builds one, so this is just an isosceles triangle
+        // three units tall, sized to sit on MyClass's offsets without overlapping
+        const glm::vec3 corners[3] = {glm::vec3(-1.5f, -1.5f, 0.0f), glm::vec3(1.5f, -1.5f, 0.0f),
+                                      glm::vec3(0.0f, 1.5f, 0.0f)};
+        for (const glm::vec3 &corner : corners) {
+            glm::vec3 position = corner + offset;
+            vertices.push_back({{position.x, position.y, position.z}, {color[0], color[1], color[2]},
+                                (uint8_t) (bobs ? 255 : 0)});
+        }
+    }
+
+    static void _addCube(std::vector<CrowdVertex> &vertices, const uint8_t *color) {
+        const int faces[6][4] = {{0, 1, 3, 2}, {4, 6, 7, 5}, {0, 4, 5, 1}, {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 5, 7, 3}};
+        for (const auto &face : faces) {
+            const int order[6] = {face[0], face[1], face[2], face[0], face[2], face[3]};
+            for (int corner : order) {
+                vertices.push_back({{(corner & 4) ? 0.5f : -0.5f, (corner & 2) ? 0.5f : -0.5f,
+                                     (corner & 1) ? 0.5f : -0.5f}, {color[0], color[1], color[2]}, 0});
+            }
+        }
+    }
+
+    // _buildMesh() ////////////////////////////////////////////////////////////
+    //
+    //  Bakes the layout of MyClass::draw_triangleman() around the stand-in
+    //      triangle: green up top (the piece that bobs), blue and red below,
+    //      and the unit cube between them which picks up the blue material
+    //      left set by triangeblue().
+    //
+    ////////////////////////////////////////////////////////////////////////////
+    static void _buildMesh(std::vector<CrowdVertex> &vertices) {
+        const uint8_t RED[3] = {230, 0, 0}, GREEN[3] = {0, 230, 0}, BLUE[3] = {0, 0, 230};
+        _addTriangle(vertices, glm::vec3(1.75f, 2.5f, 0.0f), GREEN, true);
+        _addTriangle(vertices, glm::vec3(2.5f, -2.0f, 0.0f), BLUE, false);
+        _addCube(vertices, BLUE);
+        _addTriangle(vertices, glm::vec3(-2.5f, -2.0f, 0.0f), RED, false);
+    }
+
+    static constexpr const char *VERTEX_SHADER = R"(
+#version 410 core
+uniform mat4 viewProjection[4];
+uniform int numViews;
+uniform float time;
+
+layout(location = 0) in vec3 vPos;
+layout(location = 1) in vec4 vColor;         // rgb color, a = bob weight
+layout(location = 2) in vec3 iPosition;
+layout(location = 3) in vec2 iFacingPhase;   // fractions of a turn / of the bob cycle
+
+out vec3 vsColor;
+flat out int vsViewIndex;
+
+const float TWO_PI = 6.28318530718;
+const float BOB_HEIGHT = 5.0;                // MyClass::upsome when up
+const float BOB_RATE = 1.5;                  // cycles per second
+
+void main() {
+    // MyClass::up / upsome, smoothed and offset per instance
+    float bob = BOB_HEIGHT * (0.5 - 0.5 * cos(TWO_PI * (time * BOB_RATE + iFacingPhase.y)));
+    vec3 local = vPos + vec3(0.0, 0.0, bob * vColor.a);
+
+    // rotate by thata + pi/2 about Y, as draw_triangleman() does
+    float angle = iFacingPhase.x * TWO_PI + 1.57;
+    float c = cos(angle), s = sin(angle);
+    vec3 rotated = vec3(c * local.x + s * local.z, local.y, -s * local.x + c * local.z);
+
+    vsColor = vColor.rgb;
+    vsViewIndex = gl_InstanceID % numViews;
+    gl_Position = viewProjection[vsViewIndex] * vec4(iPosition + rotated, 1.0);
+}
+)";
+
+    static constexpr const char *GEOMETRY_SHADER = R"(
+#version 410 core
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in vec3 vsColor[];
+flat in int vsViewIndex[];
+
+out vec3 color;
+
+void main() {
+    for (int i = 0; i < 3; i++) {
+        gl_Position = gl_in[i].gl_Position;
+        gl_ViewportIndex = vsViewIndex[0];
+        color = vsColor[i];
+        EmitVertex();
+    }
+    EndPrimitive();
+}
+)";
+
+    static constexpr const char *FRAGMENT_SHADER = R"(
+#version 410 core
+in vec3 color;
+out vec4 fragColorOut;
+void main() {
+    fragColorOut = vec4(color, 1.0);
+}
+)";
+
+    GLuint _shaderProgram = 0;
+    GLint _viewProjectionLocation = -1, _numViewsLocation = -1, _timeLocation = -1;
+
+    GLuint _vao = 0, _vertexBuffer = 0;
+    GLuint _sourceBuffer = 0;            // every instance, ordered by cell
+    GLuint _instanceBuffer = 0;          // this frame's visible instances
+    GLsizei _numVertices = 0;
+    GLsizei _numVisible = 0;
+
+    std::vector<CrowdInstance> _instances;
+    std::vector<Cell> _cells;            // cell 0 is the hero alone
+};
+
+#endif //A3_TRIANGLEMANCROWD_H
@@ -20,10 +20,13 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 // include C and C++ libraries
+#include <chrono>               // for timing startup
 #include <cmath>                // for cos(), sin() functionality
 #include <cstdio>                // for printf functionality
 #include <cstdlib>                // for exit functionality
 #include <ctime>                // for time() functionality
+#include <filesystem>
+#include <string>
 #include <vector>
 
 // include our class libraries
@@ -34,6 +37,27 @@
 #include <cmath>
 
 #include "Heros/MyClass.h"
+#include "Heros/TriangleManCrowd.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#define A3_ALLOCATION_COUNTER_IMPLEMENTATION
+#include "Engine/AllocationCounter.h"
+
+#include "Engine/Allocators.h"
+#include "Engine/ClusteredLights.h"
+#include "Engine/FrameCapture.h"
+#include "Engine/GpuTimer.h"
+#include "Engine/MeshLoader.h"
+#include "Engine/MeshRenderer.h"
+#include "Engine/MultiView.h"
+#include "Engine/ParticleSystem.h"
+#include "Engine/ShaderUtils.h"
+#include "Engine/ShadowMaps.h"
+#include "Engine/Terrain.h"
+#include "Engine/TextureLoader.h"
+#include "Engine/TreeRenderer.h"
 
 //*************************************************************************************
 //
@@ -52,6 +76,13 @@ float NotEvanVaughanYLocation = 0;
 
 float TriangleManXLocation = 10;
 float TriangleManYLocation = 10;
+float TriangleManFacing = 1;
+
+// every TriangleMan in the world, instance 0 being our hero
+TriangleManCrowd triangleManCrowd;
+const GLsizei CROWD_SIZE = 50000;
+const float CROWD_SPACING = 8.0f;
+const float TRIANGLEMAN_HIP_HEIGHT = 3.5f;    // lifts the lowest triangle corners onto the ground
 
 int carWidth = 4;
 int carLength = 8;
@@ -71,6 +102,10 @@ bool freeCam = true;
 
 bool zoomFunc = false;
 
+// split screen: every hero gets a camera, V cycles between 1, 2 and 4 views
+MultiView multiView;
+int numSplitViews = 1;
+
 enum heros {
     NotEvanVaughan,
     TriangleMan
@@ -96,6 +131,64 @@ std::vector<TreeLeavesData> treeLeafLayer1;
 std::vector<TreeLeavesData> treeLeafLayer2;
 std::vector<TreeLeavesData> treeLeafLayer3;
 
+// the same trees as packed 16 byte instances, drawn in a single call.  B
+//  cycles to the same instanced call with full precision attributes and then
+//  to the old per-cube path, so packing and instancing can be timed apart;
+//  each path has its own timer so the last time of every one stays on hand
+enum TreePath {
+    PACKED_TREES,
+    FULL_TREES,
+    PER_CUBE_TREES,
+    NUM_TREE_PATHS
+};
+const char *TREE_PATH_NAMES[NUM_TREE_PATHS] = {"packed", "full", "per-cube"};
+TreeRenderer treeRenderer;
+TreePath treePath = PACKED_TREES;
+GpuTimer treeTimers[NUM_TREE_PATHS];
+int statsFrame = 0;
+
+glm::vec3 lightPosition(10.0f, 10.0f, 10.0f);
+glm::vec3 lightColor(1.0f, 1.0f, 1.0f);
+
+// the car's headlights and the street lamps, binned into clusters every frame;
+//  L cycles through LIGHT_COUNTS
+ClusteredLights clusteredLights;
+const int LIGHT_COUNTS[] = {1, 64, 1024};
+int numPointLights = 64;
+const float LAMP_SPACING = 20.0f;
+const float LAMP_HEIGHT = 6.0f;
+
+// sun shadows: the forest and terrain are cached, the car and heroes redrawn every frame
+ShadowMaps shadowMaps;
+GpuTimer shadowTimer;
+const float SHADOW_HALF_EXTENT = 80.0f;       // covers the forest and the drivable area
+
+// dust kicked up by each wheel and exhaust from the tailpipe, simulated on the GPU
+ParticleSystem particles;
+const int EXHAUST_EMITTER = 4;                 // emitters 0-3 are the wheels
+const float PARTICLE_FILL_RATE = 1.0e9f;       // respawns every dead particle at once
+bool fillParticles = false;                    // --particles fill: hold the whole pool live
+double lastFrameTime = 0.0;
+glm::vec3 lastCarPosition(0.0f);
+
+// artist models that replace the cube car and our TriangleMan once imported;
+//  none ship, so without them both are drawn as before.  Models are +Y up,
+//  +Z forward, in world units, with the origin on the ground
+MeshLoader meshLoader;
+MeshRenderer meshRenderer;
+const char *CAR_MODEL_PATH = "models/car.obj";
+const char *HERO_MODEL_PATH = "models/hero.obj";
+MeshLoader::Handle carMesh = MeshLoader::NO_MESH;
+MeshLoader::Handle heroMesh = MeshLoader::NO_MESH;
+const glm::vec3 HERO_COLOR(0.9f, 0.0f, 0.0f);
+
+// per-frame scratch comes from the frame arena; debug builds count heap
+//  allocations so --check-allocations can fail a run whose frames hit the heap
+const size_t FRAME_ARENA_SIZE = 8 * 1024 * 1024;
+const int ALLOCATION_WARMUP_FRAMES = 120;      // frames after a change of state before allocations count
+bool checkAllocations = false;
+int steadyFrames = 0;
+int allocatingFrames = 0;
 
 // values to track our grid properties
 const glm::vec3 WHITE_COLOR(1.0f, 1.0f, 1.0f);
@@ -103,8 +196,8 @@ const glm::vec3 BLACK_COLOR(0.2f, 0.2f, 0.2f);
 const glm::vec3 GRASS_COLOR(0.2f, 0.4f, 0.2f);
 const float step = 0.9f;
 
-GLuint gridVAO = 0;
-GLuint numGridPoints = 0;
+// the ground: a CDLOD heightmap terrain that everything else stands on
+Terrain terrain;
 
 //because the direction vector is unit length, and we probably don't want
 //to move one full unit every time a button is pressed, just create a constant
@@ -115,6 +208,48 @@ const GLfloat MOVEMENT_CONSTANT = 1.5f;
 
 bool mackHack = false;
 
+bool firstFrameReported = false;
+
+// QA recordings: R toggles capture into CAPTURE_DIRECTORY, or pass --capture
+FrameCapture frameCapture;
+std::string captureDirectory = "captures";
+FrameCapture::Format captureFormat = FrameCapture::RAW_RGBA;
+bool captureRequested = false;
+
+// textures are decoded off the main thread and streamed in as they finish
+TextureLoader textureLoader;
+TextureLoader::Handle carTexture;
+
+// a simple unlit textured program for anything SimpleShader3 can't texture
+GLuint texturedShaderProgram = 0;
+GLint texturedMvpLocation = -1;
+GLint texturedSamplerLocation = -1;
+
+GLuint signVAO = 0;
+const glm::vec3 SIGN_POSITION(0.0f, 0.0f, -56.0f);
+
+const char *TEXTURED_VERTEX_SHADER = R"(
+#version 410 core
+uniform mat4 mvpMatrix;
+layout(location = 0) in vec3 vPos;
+layout(location = 1) in vec2 vTexCoord;
+out vec2 texCoord;
+void main() {
+    texCoord = vTexCoord;
+    gl_Position = mvpMatrix * vec4(vPos, 1.0);
+}
+)";
+
+const char *TEXTURED_FRAGMENT_SHADER = R"(
+#version 410 core
+uniform sampler2D textureMap;
+in vec2 texCoord;
+out vec4 fragColorOut;
+void main() {
+    fragColorOut = texture(textureMap, texCoord);
+}
+)";
+
 // END GLOBAL VARIABLES
 //********************************************************************************
 
@@ -150,6 +285,131 @@ void recomputeOrientation() {
     }
 }
 
+// notEvanVaughanViewMatrix() //////////////////////////////////////////////////
+//
+//  The camera the user drives with Z and the mouse: first person from the
+//      car, an arc ball around it, or the free camera.
+//
+////////////////////////////////////////////////////////////////////////////////
+glm::mat4 notEvanVaughanViewMatrix() {
+    float ground = terrain.heightAt(NotEvanVaughanXLocation, NotEvanVaughanYLocation);
+
+    glm::mat4 viewMtx = glm::lookAt(glm::vec3(NotEvanVaughanXLocation, ground + 8, NotEvanVaughanYLocation),
+                                    camDir + glm::vec3(NotEvanVaughanXLocation, ground, NotEvanVaughanYLocation),
+                                    glm::vec3(0, 1, 0));
+
+    if (arcBall) {
+        viewMtx = glm::lookAt((camDir + glm::vec3(NotEvanVaughanXLocation, ground, NotEvanVaughanYLocation)),
+                              glm::vec3(NotEvanVaughanXLocation, ground, NotEvanVaughanYLocation),
+                              glm::vec3(0, 1, 0));
+
+    } else if (freeCam) {
+        viewMtx = glm::lookAt( glm::vec3(camPos.x, camPos.y, camPos.z),
+                               camPos + camDir,
+                               glm::vec3(  0,  1,  0 ) );
+    }
+    return viewMtx;
+}
+
+// computeViews() //////////////////////////////////////////////////////////////
+//
+//  Lays out numSplitViews cameras over the framebuffer: NotEvanVaughan's
+//      camera, a chase camera behind TriangleMan, a chase camera behind the
+//      car and an overhead map, in that order.
+//
+////////////////////////////////////////////////////////////////////////////////
+void computeViews(GLint framebufferWidth, GLint framebufferHeight) {
+    const glm::vec3 carPosition(NotEvanVaughanXLocation, terrain.heightAt(NotEvanVaughanXLocation, NotEvanVaughanYLocation),
+                                NotEvanVaughanYLocation);
+    const glm::vec3 triangleManPosition(TriangleManXLocation, terrain.heightAt(TriangleManXLocation, TriangleManYLocation),
+                                        TriangleManYLocation);
+    const glm::vec3 triangleManForward(cos(TriangleManFacing), 0, -sin(TriangleManFacing));
+    const glm::vec3 carForward(sin(carRotation), 0, cos(carRotation));
+
+    const glm::mat4 viewMatrices[MultiView::MAX_VIEWS] = {
+            notEvanVaughanViewMatrix(),
+            glm::lookAt(triangleManPosition - 20.0f * triangleManForward + glm::vec3(0, 10, 0),
+                        triangleManPosition + glm::vec3(0, 3, 0), glm::vec3(0, 1, 0)),
+            glm::lookAt(carPosition - 25.0f * carForward + glm::vec3(0, 12, 0),
+                        carPosition, glm::vec3(0, 1, 0)),
+            glm::lookAt(glm::vec3(0, 150, 1), glm::vec3(0, 0, 0), glm::vec3(0, 1, 0))
+    };
+
+    // 1 view fills the window, 2 split it left / right, 4 take a quadrant each
+    const int columns = numSplitViews == 1 ? 1 : 2;
+    const int rows = numSplitViews > 2 ? 2 : 1;
+    const GLsizei width = framebufferWidth / columns, height = framebufferHeight / rows;
+
+    MultiView::View views[MultiView::MAX_VIEWS];
+    for (int i = 0; i < numSplitViews; i++) {
+        views[i].viewMtx = viewMatrices[i];
+        views[i].projMtx = glm::perspective(45.0f, (GLfloat) width / (GLfloat) height, 0.001f, 1000.0f);
+        views[i].x = (i % columns) * width;
+        views[i].y = (rows - 1 - i / columns) * height;
+        views[i].width = width;
+        views[i].height = height;
+    }
+    multiView.setViews(views, numSplitViews);
+}
+
+// updateHeadlights() //////////////////////////////////////////////////////////
+//
+//  Places the headlights a few units ahead of either front corner of the
+//      car so their pools land on the road in front of it.
+//
+////////////////////////////////////////////////////////////////////////////////
+void updateHeadlights() {
+    std::vector<ClusteredLights::PointLight> &lights = clusteredLights.lights();
+    const glm::vec3 carPosition(NotEvanVaughanXLocation, terrain.heightAt(NotEvanVaughanXLocation, NotEvanVaughanYLocation),
+                                NotEvanVaughanYLocation);
+    const glm::vec3 carForward(sin(carRotation), 0, cos(carRotation));
+    const glm::vec3 carSide(cos(carRotation), 0, -sin(carRotation));
+
+    for (size_t i = 0; i < lights.size() && i < 2; i++) {
+        const float side = i == 0 ? -1.0f : 1.0f;
+        lights[i].position = carPosition + carForward * (carLength / 2.0f + 6.0f) +
+                             carSide * (side * carWidth / 2.0f) + glm::vec3(0.0f, 2.0f, 0.0f);
+    }
+}
+
+// generateLights() ////////////////////////////////////////////////////////////
+//
+//  Makes count point lights: the car's two headlights first, then street
+//      lamps on a LAMP_SPACING grid centered on the origin, standing on the
+//      terrain.  The headlights follow the car in updateHeadlights().
+//
+////////////////////////////////////////////////////////////////////////////////
+void generateLights(int count) {
+    std::vector<ClusteredLights::PointLight> &lights = clusteredLights.lights();
+    lights.clear();
+
+    const int numHeadlights = count < 2 ? count : 2;
+    for (int i = 0; i < numHeadlights; i++) {
+        lights.push_back({glm::vec3(0.0f), 30.0f, glm::vec3(1.5f, 1.5f, 1.3f), 0.0f});
+    }
+
+    const int numLamps = count - numHeadlights;
+    const int lampColumns = (int) ceil(sqrt((double) numLamps));
+    for (int i = 0; i < numLamps; i++) {
+        float x = (i % lampColumns - (lampColumns - 1) / 2.0f) * LAMP_SPACING;
+        float z = (i / lampColumns - (lampColumns - 1) / 2.0f) * LAMP_SPACING;
+        lights.push_back({glm::vec3(x, terrain.heightAt(x, z) + LAMP_HEIGHT, z), 18.0f,
+                          glm::vec3(1.0f, 0.75f, 0.4f), 0.0f});
+    }
+    updateHeadlights();
+    steadyFrames = 0;
+}
+
+// selectTreePath() ////////////////////////////////////////////////////////////
+//
+//  Switches the tree pass, shadows included, to path.
+//
+////////////////////////////////////////////////////////////////////////////////
+void selectTreePath(TreePath path) {
+    treePath = path;
+    treeRenderer.setFormat(path == FULL_TREES ? TreeRenderer::FULL_FORMAT : TreeRenderer::PACKED_FORMAT);
+}
+
 //*************************************************************************************
 //
 // Event Callbacks
@@ -201,6 +461,20 @@ static void keyboard_callback(GLFWwindow *window, int key, int scancode, int act
             case GLFW_KEY_Q:
                 glfwSetWindowShouldClose(window, GLFW_TRUE);
                 break;
+            case GLFW_KEY_B:
+                selectTreePath((TreePath) ((treePath + 1) % NUM_TREE_PATHS));
+                break;
+            case GLFW_KEY_R:
+                captureRequested = !captureRequested;
+                break;
+            case GLFW_KEY_V:
+                numSplitViews = numSplitViews == 1 ? 2 : (numSplitViews == 2 ? MultiView::MAX_VIEWS : 1);
+                break;
+            case GLFW_KEY_L:
+                numPointLights = numPointLights == LIGHT_COUNTS[0] ? LIGHT_COUNTS[1] :
+                                 (numPointLights == LIGHT_COUNTS[1] ? LIGHT_COUNTS[2] : LIGHT_COUNTS[0]);
+                generateLights(numPointLights);
+                break;
             case GLFW_KEY_W:
                 if (selectedHero == NotEvanVaughan) {
                     rotateWheelSpeed -= 0.5f;
@@ -351,16 +625,14 @@ static void mouse_button_callback(GLFWwindow *window, int button, int action, in
 
 // generateEnvironment() ///////////////////////////////////////////////////////
 //
-//  This function creates our world which will consist of a grid in the XZ-Plane
-//      and randomly placed and sized buildings of varying colors.
+//  This function creates our world which will consist of randomly placed and
+//      sized trees standing on the terrain.
 //
 ////////////////////////////////////////////////////////////////////////////////
 void generateEnvironment() {
     // parameters to size our world
     const GLint GRID_WIDTH = 100;
     const GLint GRID_LENGTH = 100;
-    const GLfloat GRID_SPACING_WIDTH = 1.0f;
-    const GLfloat GRID_SPACING_LENGTH = 1.0f;
     const GLfloat LEFT_END_POINT = -GRID_WIDTH / 2.0f - 5;
     const GLfloat RIGHT_END_POINT = GRID_WIDTH / 2.0f + 5;
     const GLfloat BOTTOM_END_POINT = -GRID_LENGTH / 2.0f - 5;
@@ -371,9 +643,10 @@ void generateEnvironment() {
             if (row % 2 == 0 && column % 2 == 0 && getRand() < 0.05) {
 
                 float treeHeight = getRand() * 20;
+                float groundHeight = terrain.heightAt(row, column);
 
                 glm::mat4 trunkScaleMatrix = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, treeHeight / 8, 1.0f));
-                glm::mat4 trunkTranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, 0.0f, column));
+                glm::mat4 trunkTranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, groundHeight, column));
                 glm::mat4 trunkHeightTranslationMatrix = glm::translate(glm::mat4(1.0f),
                                                                         glm::vec3(0.0f, treeHeight / 8, 0.0f));
 
@@ -381,7 +654,7 @@ void generateEnvironment() {
                                            glm::vec3(0.38, 0.2, 0.07)};
 
                 glm::mat4 leaf1ScaleMatrix = glm::scale(glm::mat4(1.0f), glm::vec3(2.0f, treeHeight / 8, 2.0f));
-                glm::mat4 leaf1TranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, 0.0f, column));
+                glm::mat4 leaf1TranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, groundHeight, column));
                 glm::mat4 leaf1HeightTranslationMatrix = glm::translate(glm::mat4(1.0f),
                                                                         glm::vec3(0.0f, 2 * treeHeight / 8, 0.0f));
 
@@ -389,7 +662,7 @@ void generateEnvironment() {
                                             glm::vec3(0, 1, 0)};
 
                 glm::mat4 leaf2ScaleMatrix = glm::scale(glm::mat4(1.0f), glm::vec3(1.5f, treeHeight / 8, 1.5f));
-                glm::mat4 leaf2TranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, 0.0f, column));
+                glm::mat4 leaf2TranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, groundHeight, column));
                 glm::mat4 leaf2HeightTranslationMatrix = glm::translate(glm::mat4(1.0f),
                                                                         glm::vec3(0.0f, 3 * treeHeight / 8, 0.0f));
 
@@ -397,7 +670,7 @@ void generateEnvironment() {
                                             glm::vec3(0, 1, 0)};
 
                 glm::mat4 leaf3ScaleMatrix = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, treeHeight / 8, 1.0f));
-                glm::mat4 leaf3TranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, 0.0f, column));
+                glm::mat4 leaf3TranslationMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(row, groundHeight, column));
                 glm::mat4 leaf3HeightTranslationMatrix = glm::translate(glm::mat4(1.0f),
                                                                         glm::vec3(0.0f, 4 * treeHeight / 8, 0.0f));
 
@@ -409,31 +682,84 @@ void generateEnvironment() {
                 treeLeafLayer2.push_back(treeLeaf2);
                 treeLeafLayer3.push_back(treeLeaf3);
 
+                treeRenderer.addCube(glm::vec3(row, groundHeight + treeHeight / 8, column), 1.0f, treeHeight / 8,
+                                     TreeRenderer::TRUNK_BROWN);
+                treeRenderer.addCube(glm::vec3(row, groundHeight + 2 * treeHeight / 8, column), 2.0f, treeHeight / 8,
+                                     TreeRenderer::LEAF_GREEN);
+                treeRenderer.addCube(glm::vec3(row, groundHeight + 3 * treeHeight / 8, column), 1.5f, treeHeight / 8,
+                                     TreeRenderer::LEAF_GREEN);
+                treeRenderer.addCube(glm::vec3(row, groundHeight + 4 * treeHeight / 8, column), 1.0f, treeHeight / 8,
+                                     TreeRenderer::LEAF_GREEN);
+
             }
         }
     }
+    treeRenderer.upload();
+}
 
-    // create the grid - do not edit this code
-    std::vector<glm::vec3> points;
-    for (GLfloat i = LEFT_END_POINT; i <= RIGHT_END_POINT; i += GRID_SPACING_WIDTH) {
-        points.emplace_back(glm::vec3(i, 0, BOTTOM_END_POINT));
-        points.emplace_back(glm::vec3(i, 0, TOP_END_POINT));
-    }
-    for (GLfloat j = BOTTOM_END_POINT; j <= TOP_END_POINT; j += GRID_SPACING_LENGTH) {
-        points.emplace_back(glm::vec3(LEFT_END_POINT, 0, j));
-        points.emplace_back(glm::vec3(RIGHT_END_POINT, 0, j));
+// generateCrowd() /////////////////////////////////////////////////////////////
+//
+//  Scatters CROWD_SIZE TriangleMen on a jittered grid around the world, each
+//      with a random facing and bob phase.  Instance 0 is reserved for our
+//      hero and is placed every frame in placeTriangleMan().
+//
+////////////////////////////////////////////////////////////////////////////////
+void generateCrowd() {
+    triangleManCrowd.init(CROWD_SIZE);
+
+    const GLint CROWD_COLUMNS = (GLint) ceil(sqrt((double) CROWD_SIZE));
+    for (GLsizei i = 1; i < CROWD_SIZE; i++) {
+        float x = (i % CROWD_COLUMNS - CROWD_COLUMNS / 2.0f) * CROWD_SPACING + (getRand() - 0.5f) * CROWD_SPACING / 2;
+        float z = (i / CROWD_COLUMNS - CROWD_COLUMNS / 2.0f) * CROWD_SPACING + (getRand() - 0.5f) * CROWD_SPACING / 2;
+        triangleManCrowd.setInstance(i, glm::vec3(x, terrain.heightAt(x, z) + TRIANGLEMAN_HIP_HEIGHT, z), getRand() * 2 * M_PI, getRand());
     }
-    numGridPoints = points.size();
-    gridVAO = CSCI441::SimpleShader3::registerVertexArray(points, std::vector<glm::vec3>(numGridPoints));
+    triangleManCrowd.upload();
 }
 
-void drawWheel(int wheelNumber) {
+// generateSign() //////////////////////////////////////////////////////////////
+//
+//  Builds a textured billboard at the edge of the world to show off our car
+//      image.  It draws with the loader's placeholder until the image is in.
+//
+////////////////////////////////////////////////////////////////////////////////
+void generateSign() {
+    struct SignVertex {
+        GLfloat x, y, z;
+        GLfloat s, t;
+    };
+    const SignVertex vertices[] = {
+            {-8.0f,  4.0f, 0.0f, 0.0f, 0.0f},
+            { 8.0f,  4.0f, 0.0f, 1.0f, 0.0f},
+            {-8.0f, 14.0f, 0.0f, 0.0f, 1.0f},
+            { 8.0f, 14.0f, 0.0f, 1.0f, 1.0f}
+    };
+
+    glGenVertexArrays(1, &signVAO);
+    glBindVertexArray(signVAO);
+
+    GLuint signVBO;
+    glGenBuffers(1, &signVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, signVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(SignVertex), (void *) 0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(SignVertex), (void *) (3 * sizeof(GLfloat)));
+
+    glBindVertexArray(0);
+}
+
+// wheelOffset() ///////////////////////////////////////////////////////////////
+//
+//  Where wheel 1-4 sits relative to the car's origin, at ground level.
+//
+////////////////////////////////////////////////////////////////////////////////
+glm::vec3 wheelOffset(int wheelNumber) {
 
     float x_location = 0;
     float z_location = 0;
 
-    float wheelFacing = float(M_PI / 2);
-
     switch (wheelNumber) {
         case 1:
             x_location = -3 * carWidth / 4;
@@ -447,21 +773,27 @@ void drawWheel(int wheelNumber) {
         case 3:
             x_location = 3 * carWidth / 4;
             z_location = carLength / 2;
-            wheelFacing += float(M_PI);
             break;
 
         case 4:
             x_location = +3 * carWidth / 4;
             z_location = -carLength / 2;
-            wheelFacing += float(M_PI);
-
             break;
 
         default:
             break;
     }
+    return glm::vec3(x_location, 0.0f, z_location);
+}
+
+void drawWheel(int wheelNumber) {
+
+    float wheelFacing = float(M_PI / 2);
+    if (wheelNumber >= 3) {
+        wheelFacing += float(M_PI);    // the right hand wheels face the other way
+    }
 
-    glm::mat4 positionDisk = glm::translate(glm::mat4(1.0f), glm::vec3(x_location, 0.0f, z_location));
+    glm::mat4 positionDisk = glm::translate(glm::mat4(1.0f), wheelOffset(wheelNumber));
 
     glm::mat4 scaleDisk = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, 1.0f, 1.0f));
     glm::mat4 rotateDisk = glm::rotate(glm::mat4(1.0f), wheelFacing, CSCI441::X_AXIS);
@@ -558,17 +890,66 @@ void drawNotEvanVaughan() {
     drawWheel(4);
 }
 
-void drawTriangleMan () {
+// where the car and our TriangleMan stand on the terrain and which way they face
+glm::mat4 carModelMatrix() {
+    const glm::vec3 position(NotEvanVaughanXLocation, terrain.heightAt(NotEvanVaughanXLocation, NotEvanVaughanYLocation),
+                             NotEvanVaughanYLocation);
+    return glm::rotate(glm::translate(glm::mat4(1.0f), position), carRotation, CSCI441::Y_AXIS);
+}
 
+glm::mat4 heroModelMatrix() {
+    const glm::vec3 position(TriangleManXLocation, terrain.heightAt(TriangleManXLocation, TriangleManYLocation),
+                             TriangleManYLocation);
+    return glm::rotate(glm::translate(glm::mat4(1.0f), position), TriangleManFacing + float(M_PI / 2),
+                       CSCI441::Y_AXIS);
+}
 
+// moves crowd instance 0 to wherever the player has walked our TriangleMan
+void placeTriangleMan() {
+    triangleManCrowd.setInstance(0, glm::vec3(TriangleManXLocation,
+                                           terrain.heightAt(TriangleManXLocation, TriangleManYLocation) + TRIANGLEMAN_HIP_HEIGHT,
+                                           TriangleManYLocation),
+                                 TriangleManFacing, 0.0f);
+    triangleManCrowd.uploadInstance(0);
+}
 
+// the crowd, with our TriangleMan swapped for the hero model once it has loaded
+void drawTriangleMan(const MultiView &views) {
+    const MeshLoader::Mesh *hero = meshLoader.getMesh(heroMesh);
+    triangleManCrowd.draw(views, (float) glfwGetTime(), hero == nullptr);
+    if (hero) {
+        meshRenderer.draw(*hero, heroModelMatrix(), HERO_COLOR, views, clusteredLights, shadowMaps,
+                          lightPosition, lightColor);
+    }
 }
 
-// renderScene() ///////////////////////////////////////////////////////////////
+// reportFirstFrame() //////////////////////////////////////////////////////////
+//
+//  Prints how long it took from launch until the first frame was finished,
+//      along with how the program binary cache fared.  Run once with an
+//      empty shader_cache/ directory and once more to compare cold and warm.
 //
 ////////////////////////////////////////////////////////////////////////////////
-void renderScene() {
-    // LOOK HERE #1 draw all the buildings
+void reportFirstFrame(std::chrono::steady_clock::time_point launchTime) {
+    if (firstFrameReported) return;
+    firstFrameReported = true;
+
+    glFinish();    // only once, so we time the GPU work and not just the submission
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - launchTime).count();
+
+    const ShaderUtils::ProgramCacheStats &stats = ShaderUtils::programCacheStats();
+    const char *temperature = stats.misses == 0 ? "warm" : (stats.hits == 0 ? "cold" : "partial");
+    fprintf(stdout, "[INFO]: first frame after %.1f ms (%s shader cache: %d loaded, %d compiled, %.1f ms building programs)\n",
+            milliseconds, temperature, stats.hits, stats.misses, stats.milliseconds);
+}
+
+// drawTreesLegacy() ///////////////////////////////////////////////////////////
+//
+//  The original one draw per cube path, kept to compare against the packed
+//      instanced trees.
+//
+////////////////////////////////////////////////////////////////////////////////
+void drawTreesLegacy() {
     for (int i = 0; i < treeTrunks.size(); i++) {
 
         TreeTrunkData currentTrunk = treeTrunks.at(i);
@@ -596,10 +977,74 @@ void renderScene() {
         CSCI441::drawSolidCube(1.0);
         CSCI441::SimpleShader3::popTransformation();
     }
+}
+
+// reportTreeBandwidth() ///////////////////////////////////////////////////////
+//
+//  Every couple of seconds prints the measured GPU time of the tree pass for
+//      every path run so far (0 until it has been), next to the estimated
+//      attribute traffic of the packed and full instanced formats.
+//
+////////////////////////////////////////////////////////////////////////////////
+void reportTreeBandwidth() {
+    if (++statsFrame % 120 != 0) return;
+
+    const TreeRenderer::AttributeBytes packed = treeRenderer.estimateBytesPerFrame(TreeRenderer::PACKED_FORMAT);
+    const TreeRenderer::AttributeBytes full = treeRenderer.estimateBytesPerFrame(TreeRenderer::FULL_FORMAT);
+    fprintf(stdout, "[INFO]: trees (%s): %d cubes, GPU packed %.3f / full %.3f / per-cube %.3f ms "
+                    "(est. packed vs full: vertices %.1f vs %.1f KB, instances %.1f vs %.1f KB, indices %.1f KB)\n",
+            TREE_PATH_NAMES[treePath], treeRenderer.numInstances(), treeTimers[PACKED_TREES].lastMilliseconds(),
+            treeTimers[FULL_TREES].lastMilliseconds(), treeTimers[PER_CUBE_TREES].lastMilliseconds(),
+            packed.vertices / 1024.0, full.vertices / 1024.0, packed.instances / 1024.0, full.instances / 1024.0,
+            packed.indices / 1024.0);
+}
+
+// drawSign() //////////////////////////////////////////////////////////////////
+//
+////////////////////////////////////////////////////////////////////////////////
+void drawSign(glm::mat4 viewMtx, glm::mat4 projMtx) {
+    glm::mat4 modelMtx = glm::translate(glm::mat4(1.0f), SIGN_POSITION +
+                                        glm::vec3(0.0f, terrain.heightAt(SIGN_POSITION.x, SIGN_POSITION.z), 0.0f));
+    glm::mat4 mvpMtx = projMtx * viewMtx * modelMtx;
+
+    glUseProgram(texturedShaderProgram);
+    glUniformMatrix4fv(texturedMvpLocation, 1, GL_FALSE, &mvpMtx[0][0]);
+    glUniform1i(texturedSamplerLocation, 0);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, textureLoader.getTexture(carTexture));
+
+    glBindVertexArray(signVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
 
+    // hand the pipeline back to SimpleShader3
+    glUseProgram(0);
+}
+
+// useView() ///////////////////////////////////////////////////////////////////
+//
+//  Points the viewport and SimpleShader3 at one of the split screen views.
+//
+////////////////////////////////////////////////////////////////////////////////
+void useView(const MultiView &views, int index) {
+    const MultiView::View &view = views.view(index);
+    glViewport(view.x, view.y, view.width, view.height);
+    CSCI441::SimpleShader3::setProjectionMatrix(view.projMtx);
+    CSCI441::SimpleShader3::setViewMatrix(view.viewMtx);
+}
+
+// drawCar() ///////////////////////////////////////////////////////////////////
+//
+//  Places NotEvanVaughan on the terrain and draws it with SimpleShader3.
+//
+////////////////////////////////////////////////////////////////////////////////
+void drawCar() {
     CSCI441::SimpleShader3::setMaterialColor(WHITE_COLOR);
 
-    glm::mat4 positionCar = glm::translate(glm::mat4(1.0f), glm::vec3(NotEvanVaughanXLocation, 0.0f, NotEvanVaughanYLocation));
+    glm::mat4 positionCar = glm::translate(glm::mat4(1.0f), glm::vec3(NotEvanVaughanXLocation,
+                                                                      terrain.heightAt(NotEvanVaughanXLocation, NotEvanVaughanYLocation),
+                                                                      NotEvanVaughanYLocation));
     glm::mat4 rotateCar = glm::rotate(glm::mat4(1.0f), carRotation, CSCI441::Y_AXIS);
 
     CSCI441::SimpleShader3::pushTransformation(positionCar);
@@ -609,23 +1054,181 @@ void renderScene() {
 
     drawNotEvanVaughan();
 
-    glm::mat4 positionCar1 = glm::translate(glm::mat4(1.0f), glm::vec3(TriangleManXLocation, 0.0f, TriangleManYLocation));
-    CSCI441::SimpleShader3::pushTransformation(positionCar1);
-
-    drawTriangleMan();
-
     CSCI441::SimpleShader3::popTransformation();
     CSCI441::SimpleShader3::popTransformation();
+}
 
-    CSCI441::SimpleShader3::popTransformation();
-    CSCI441::SimpleShader3::popTransformation();
+// setupCarEffects() ///////////////////////////////////////////////////////////
+//
+//  Allocates the particle pool and sets up the parts of the wheel dust and
+//      exhaust emitters that never change.
+//
+////////////////////////////////////////////////////////////////////////////////
+void setupCarEffects() {
+    particles.init();
+    particles.setNumEmitters(EXHAUST_EMITTER + 1);
+
+    for (int wheel = 0; wheel < 4; wheel++) {
+        ParticleSystem::Emitter &dust = particles.emitter(wheel);
+        dust.velocity = glm::vec3(0.0f, 2.0f, 0.0f);
+        dust.spread = 3.0f;
+        dust.lifetime = 1.5f;
+        dust.gravity = 2.0f;
+        dust.drag = 1.5f;
+        dust.size = 0.6f;
+        dust.color = glm::vec4(0.55f, 0.45f, 0.3f, 0.6f);
+    }
+
+    ParticleSystem::Emitter &exhaust = particles.emitter(EXHAUST_EMITTER);
+    exhaust.spread = 0.5f;
+    exhaust.lifetime = 2.5f;
+    exhaust.gravity = -1.0f;             // warm, so it rises
+    exhaust.drag = 0.8f;
+    exhaust.size = 0.4f;
+    exhaust.color = glm::vec4(0.3f, 0.3f, 0.3f, 0.5f);
+
+    lastCarPosition = glm::vec3(NotEvanVaughanXLocation, 0.0f, NotEvanVaughanYLocation);
+}
+
+// updateCarEffects() //////////////////////////////////////////////////////////
+//
+//  Moves the emitters with the car and scales them by how fast it went this
+//      frame, then advances the particles on the GPU.  The car only moves on
+//      key presses, so the speed is measured from its position and smoothed.
+//
+////////////////////////////////////////////////////////////////////////////////
+void updateCarEffects(float deltaTime) {
+    const glm::vec3 carPosition(NotEvanVaughanXLocation, 0.0f, NotEvanVaughanYLocation);
+    const float measuredSpeed = deltaTime > 0.0f ? glm::distance(carPosition, lastCarPosition) / deltaTime : 0.0f;
+    carSpeed += (measuredSpeed - carSpeed) * glm::min(1.0f, 4.0f * deltaTime);
+    lastCarPosition = carPosition;
+
+    const glm::mat4 carMatrix = carModelMatrix();
+    const glm::vec3 carBackward = glm::vec3(carMatrix * glm::vec4(0.0f, 0.0f, -1.0f, 0.0f));
+
+    for (int wheel = 0; wheel < 4; wheel++) {
+        ParticleSystem::Emitter &dust = particles.emitter(wheel);
+        dust.position = glm::vec3(carMatrix * glm::vec4(wheelOffset(wheel + 1), 1.0f));
+        dust.velocity = carBackward * (0.3f * carSpeed) + glm::vec3(0.0f, 2.0f, 0.0f);
+        dust.rate = 400.0f * carSpeed;
+    }
+
+    ParticleSystem::Emitter &exhaust = particles.emitter(EXHAUST_EMITTER);
+    exhaust.position = glm::vec3(carMatrix * glm::vec4(1.0f, 1.0f, -carLength / 2.0f - 0.5f, 1.0f));
+    exhaust.velocity = carBackward * 2.0f;
+    exhaust.rate = 60.0f + 200.0f * carSpeed;
+
+    if (fillParticles) {
+        for (int emitter = 0; emitter <= EXHAUST_EMITTER; emitter++) particles.emitter(emitter).rate = PARTICLE_FILL_RATE;
+    }
 
+    particles.update(deltaTime);
+}
+
+// renderShadows() /////////////////////////////////////////////////////////////
+//
+//  Brings the static shadow map up to date (a no-op unless the sun moved or
+//      it was invalidated) and redraws the dynamic one with the car and our
+//      TriangleMan, as models if they have loaded.  Must run before
+//      renderScene() samples them.
+//
+////////////////////////////////////////////////////////////////////////////////
+void renderShadows() {
+    shadowTimer.begin();
+    if (shadowMaps.beginStatic(lightPosition)) {
+        shadowMaps.lightView().applyViewports();
+        treeRenderer.drawDepth(shadowMaps.lightView());
+        terrain.drawDepth(shadowMaps.lightView(), glm::vec3(0.0f));
+        shadowMaps.end();
+    }
+
+    const MeshLoader::Mesh *car = meshLoader.getMesh(carMesh);
+    const MeshLoader::Mesh *hero = meshLoader.getMesh(heroMesh);
+
+    shadowMaps.beginDynamic();
+    if (!car) {
+        useView(shadowMaps.lightView(), 0);
+        drawCar();
+    }
+    shadowMaps.lightView().applyViewports();
+    if (car) meshRenderer.drawDepth(*car, carModelMatrix(), shadowMaps.lightView());
+    if (hero) {
+        meshRenderer.drawDepth(*hero, heroModelMatrix(), shadowMaps.lightView());
+    } else {
+        triangleManCrowd.drawHero(shadowMaps.lightView(), (float) glfwGetTime());
+    }
+    shadowMaps.end();
+    shadowTimer.end();
+}
+
+// reportShadows() /////////////////////////////////////////////////////////////
+//
+//  Prints the shadow pass GPU time alongside the tree statistics.
+//
+////////////////////////////////////////////////////////////////////////////////
+void reportShadows() {
+    if (statsFrame % 120 != 0) return;
 
-    // draw our grid
-    CSCI441::SimpleShader3::disableLighting();
-    CSCI441::SimpleShader3::setMaterialColor(GRASS_COLOR);
-    CSCI441::SimpleShader3::draw(GL_TRIANGLE_STRIP, gridVAO, numGridPoints);
-    CSCI441::SimpleShader3::enableLighting();
+    fprintf(stdout, "[INFO]: shadows: %.3f ms GPU, static map rendered %d time(s)\n",
+            shadowTimer.lastMilliseconds(), shadowMaps.staticRenders());
+}
+
+// reportParticles() ///////////////////////////////////////////////////////////
+//
+//  Prints how much of the particle pool is live alongside the tree
+//      statistics.
+//
+////////////////////////////////////////////////////////////////////////////////
+void reportParticles() {
+    if (statsFrame % 120 != 0) return;
+
+    fprintf(stdout, "[INFO]: particles: %d live of %d (%.1f%%)\n", particles.liveParticles(), particles.capacity(),
+            100.0 * particles.liveParticles() / particles.capacity());
+}
+
+// renderScene() ///////////////////////////////////////////////////////////////
+//
+//  The instanced passes (trees and the TriangleMan crowd) are culled once
+//      against every view and drawn into all of them in a single call, as is
+//      the terrain, and so is the car once its model has loaded.  The sign
+//      (and the cube car before that) still go through SimpleShader3, once
+//      per view.
+//
+////////////////////////////////////////////////////////////////////////////////
+void renderScene(const MultiView &views) {
+    // LOOK HERE #1 draw all the buildings
+    treeTimers[treePath].begin();
+    if (treePath != PER_CUBE_TREES) {
+        views.applyViewports();
+        treeRenderer.draw(views, clusteredLights, shadowMaps, lightPosition, lightColor);
+    } else {
+        for (int v = 0; v < views.numViews(); v++) {
+            useView(views, v);
+            drawTreesLegacy();
+        }
+    }
+    treeTimers[treePath].end();
+
+    const MeshLoader::Mesh *car = meshLoader.getMesh(carMesh);
+    for (int v = 0; v < views.numViews(); v++) {
+        useView(views, v);
+
+        if (!car) drawCar();
+        drawSign(views.view(v).viewMtx, views.view(v).projMtx);
+    }
+
+    views.applyViewports();
+    if (car) {
+        meshRenderer.draw(*car, carModelMatrix(), WHITE_COLOR, views, clusteredLights, shadowMaps,
+                          lightPosition, lightColor);
+    }
+    drawTriangleMan(views);
+
+    // draw our ground
+    terrain.draw(views, clusteredLights, shadowMaps, lightPosition, lightColor, GRASS_COLOR);
+
+    // blended last, over everything opaque
+    particles.draw(views);
 }
 
 
@@ -639,7 +1242,7 @@ void renderScene() {
 //      Used to setup everything GLFW related.  This includes the OpenGL context
 //	and our window.
 //
-GLFWwindow *setupGLFW() {
+GLFWwindow *setupGLFW(bool visible) {
     // set what function to use when registering errors
     // this is the ONLY GLFW function that can be called BEFORE GLFW is initialized
     // all other GLFW calls must be performed after GLFW has been initialized
@@ -659,6 +1262,7 @@ GLFWwindow *setupGLFW() {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);    // request OpenGL vX.1
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);            // do not allow our window to be able to be resized
     glfwWindowHint(GLFW_DOUBLEBUFFER, GLFW_TRUE);         // request double buffering
+    glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);   // benchmarks run without showing the window
 
     // create a window for a given size, with a given title
     GLFWwindow *window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Lab02: Flight Simulator v0.41", nullptr,
@@ -672,7 +1276,7 @@ GLFWwindow *setupGLFW() {
     }
 
     glfwMakeContextCurrent(window);                            // make the created window the current window
-    glfwSwapInterval(1);                            // update our screen after at least 1 screen refresh
+    glfwSwapInterval(visible ? 1 : 0);              // update our screen after at least 1 screen refresh, benchmarks run unthrottled
 
     glfwSetKeyCallback(window, keyboard_callback);        // set our keyboard callback function
     glfwSetCursorPosCallback(window, cursor_callback);    // set our cursor position callback function
@@ -707,6 +1311,15 @@ void setupOpenGL() {
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);    // set the clear color to black
 }
 
+// models are optional, so a missing one is not an error
+MeshLoader::Handle requestModel(const char *path) {
+    if (!std::filesystem::exists(path)) {
+        fprintf(stdout, "[INFO]: no model at \"%s\", keeping the built-in one\n", path);
+        return MeshLoader::NO_MESH;
+    }
+    return meshLoader.request(path);
+}
+
 void setupScene() {
     // give the camera a scenic starting point.
     camPos.x = 60;
@@ -716,31 +1329,266 @@ void setupScene() {
     cameraPhi = M_PI / 2.8f;
     recomputeOrientation();
 
+    frameArena().init(FRAME_ARENA_SIZE);
+    terrain.init();
+    treeRenderer.init();
+    for (GpuTimer &timer : treeTimers) timer.init();
+    shadowMaps.init(glm::vec3(0.0f), SHADOW_HALF_EXTENT);
+    shadowTimer.init();
+    setupCarEffects();
+
     srand(time(nullptr));    // seed our random number generator
     generateEnvironment();
+    generateCrowd();
+    generateSign();
+
+    clusteredLights.init();
+    generateLights(numPointLights);
+
+    texturedShaderProgram = ShaderUtils::createProgram(TEXTURED_VERTEX_SHADER, TEXTURED_FRAGMENT_SHADER);
+    texturedMvpLocation = glGetUniformLocation(texturedShaderProgram, "mvpMatrix");
+    texturedSamplerLocation = glGetUniformLocation(texturedShaderProgram, "textureMap");
+
+    textureLoader.init();
+    carTexture = textureLoader.request("images/car.jpg");
+
+    meshRenderer.init();
+    meshLoader.init();
+    carMesh = requestModel(CAR_MODEL_PATH);
+    heroMesh = requestModel(HERO_MODEL_PATH);
 
     //******************************************************************
     // this is some code to enable a default light for the scene;
     // feel free to play around with this, but we won't talk about
     // lighting in OpenGL for another couple of weeks yet.
-    glm::vec3 lightPosition(10.0f, 10.0f, 10.0f);
     CSCI441::SimpleShader3::setLightPosition(lightPosition);
-
-    glm::vec3 lightColor(1.0, 1.0, 1.0);
     CSCI441::SimpleShader3::setLightColor(lightColor);
     //******************************************************************
 }
 
+// updateCapture() /////////////////////////////////////////////////////////////
+//
+//  Starts or stops recording to follow captureRequested, then queues a read
+//      of this frame.  Must run after rendering and before the swap.
+//
+////////////////////////////////////////////////////////////////////////////////
+void updateCapture(GLFWwindow *window) {
+    if (captureRequested && !frameCapture.isActive()) {
+        GLint framebufferWidth, framebufferHeight;
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+        if (!frameCapture.start(captureDirectory, framebufferWidth, framebufferHeight, captureFormat)) {
+            captureRequested = false;
+        }
+        steadyFrames = 0;
+    } else if (!captureRequested && frameCapture.isActive()) {
+        frameCapture.stop();
+        steadyFrames = 0;
+    }
+    frameCapture.captureFrame();
+}
+
+// checkFrameAllocations() /////////////////////////////////////////////////////
+//
+//  Once nothing has changed for ALLOCATION_WARMUP_FRAMES, a frame that made
+//      heap allocations on the main thread is a regression; count it and,
+//      with --check-allocations, say so.
+//
+////////////////////////////////////////////////////////////////////////////////
+void checkFrameAllocations(uint64_t allocationsBefore) {
+    const uint64_t allocations = AllocationCounter::count() - allocationsBefore;
+    if (++steadyFrames <= ALLOCATION_WARMUP_FRAMES || allocations == 0) return;
+
+    allocatingFrames++;
+    if (checkAllocations) {
+        fprintf(stderr, "[ERROR]: steady-state frame %d made %llu heap allocations\n",
+                steadyFrames, (unsigned long long) allocations);
+    }
+}
+
+// drawFrame() /////////////////////////////////////////////////////////////////
+//
+//  Renders one complete frame into the back buffer, ready to be swapped.
+//
+////////////////////////////////////////////////////////////////////////////////
+void drawFrame(GLFWwindow *window, std::chrono::steady_clock::time_point launchTime) {
+    frameArena().reset();                         // last frame's scratch is no longer needed
+    const uint64_t allocationsBefore = AllocationCounter::count();
+
+    glDrawBuffer(GL_BACK);                        // work with our back frame buffer
+    glClear(GL_COLOR_BUFFER_BIT |
+            GL_DEPTH_BUFFER_BIT);    // clear the current color contents and depth buffer in the window
+
+    // Get the size of our framebuffer.  Ideally this should be the same dimensions as our window, but
+    // when using a Retina display the actual window can be larger than the requested window.  Therefore
+    // query what the actual size of the window we are rendering to is.
+    GLint framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+
+    // update the viewports and cameras - each split screen view gets its own
+    // perspective projection with a FOV of 45 degrees, for its aspect ratio,
+    // and Z ranges from [0.001, 1000].
+    computeViews(framebufferWidth, framebufferHeight);
+
+    bodyMotion += 0.05f;
+
+    updateHeadlights();
+    clusteredLights.update(multiView);                // bin the lights for this frame's views
+
+    if (textureLoader.update()) steadyFrames = 0;     // stream in any textures the workers have finished
+    if (meshLoader.update()) steadyFrames = 0;        // and create buffers for any imported models
+
+    // clamp so a stall (or the first frame) doesn't launch every particle at once
+    const double now = glfwGetTime();
+    const float deltaTime = lastFrameTime > 0.0 ? (float) glm::min(now - lastFrameTime, 0.1) : 0.0f;
+    lastFrameTime = now;
+    updateCarEffects(deltaTime);
+
+    placeTriangleMan();
+    renderShadows();                                  // refresh the shadow maps the scene samples
+    renderScene(multiView);                           // draw everything to the window
+    reportFirstFrame(launchTime);
+    reportTreeBandwidth();
+    reportShadows();
+    reportParticles();
+
+    updateCapture(window);
+    checkFrameAllocations(allocationsBefore);
+}
+
+// timeFrames() ////////////////////////////////////////////////////////////////
+//
+//  Renders numFrames frames while the camera sweeps around the scene and
+//      returns the average wall time per frame.
+//
+////////////////////////////////////////////////////////////////////////////////
+double timeFrames(GLFWwindow *window, int numFrames, std::chrono::steady_clock::time_point launchTime) {
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < numFrames; frame++) {
+        cameraTheta += 0.01f;
+        recomputeOrientation();
+
+        drawFrame(window, launchTime);
+        glfwSwapBuffers(window);
+        glfwPollEvents();
+    }
+    glFinish();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / numFrames;
+}
+
+// runLightBenchmark() /////////////////////////////////////////////////////////
+//
+//  Times the scene with each of LIGHT_COUNTS point lights, reporting the
+//      CPU binning cost and how many light references the clusters held.
+//
+////////////////////////////////////////////////////////////////////////////////
+void runLightBenchmark(GLFWwindow *window, int numFrames, std::chrono::steady_clock::time_point launchTime) {
+    for (int count : LIGHT_COUNTS) {
+        generateLights(count);
+        const double milliseconds = timeFrames(window, numFrames, launchTime);
+        fprintf(stdout, "[INFO]: benchmark %4d lights: %d frames, %.3f ms/frame, binning %.3f ms, %zu cluster entries\n",
+                count, numFrames, milliseconds, clusteredLights.binMilliseconds(), clusteredLights.numIndices());
+    }
+    generateLights(numPointLights);
+}
+
+// runTreeBenchmark() //////////////////////////////////////////////////////////
+//
+//  Times the scene with each tree path in turn, reporting the mean GPU time
+//      of the tree pass, so packed against full shows what packing saves
+//      and full against per-cube what instancing does.
+//
+////////////////////////////////////////////////////////////////////////////////
+void runTreeBenchmark(GLFWwindow *window, int numFrames, std::chrono::steady_clock::time_point launchTime) {
+    const TreePath startPath = treePath;
+    for (int path = 0; path < NUM_TREE_PATHS; path++) {
+        selectTreePath((TreePath) path);
+        treeTimers[path].resetAverage();
+        const double milliseconds = timeFrames(window, numFrames, launchTime);
+        fprintf(stdout, "[INFO]: benchmark %-8s trees: %d frames, %.3f ms/frame, tree pass %.3f ms GPU\n",
+                TREE_PATH_NAMES[path], numFrames, milliseconds, treeTimers[path].averageMilliseconds());
+    }
+    selectTreePath(startPath);
+}
+
+// runBenchmark() //////////////////////////////////////////////////////////////
+//
+//  Renders a fixed number of frames in the hidden window while the camera
+//      sweeps around the scene and prints the average frame time.  With
+//      --capture the run is done twice, without and then with recording, so
+//      the capture overhead can be read off directly.
+//
+////////////////////////////////////////////////////////////////////////////////
+void runBenchmark(GLFWwindow *window, int numFrames, std::chrono::steady_clock::time_point launchTime) {
+    const bool compareCapture = captureRequested;
+    const int numPasses = compareCapture ? 2 : 1;
+    double passMilliseconds[2] = {0.0, 0.0};
+
+    for (int pass = 0; pass < numPasses; pass++) {
+        captureRequested = compareCapture && pass == 1;
+        passMilliseconds[pass] = timeFrames(window, numFrames, launchTime);
+
+        fprintf(stdout, "[INFO]: benchmark %s: %d frames, %.3f ms/frame, %d of %d particles live\n",
+                captureRequested ? "capture on" : "capture off", numFrames, passMilliseconds[pass],
+                particles.liveParticles(), particles.capacity());
+    }
+
+    captureRequested = false;
+    frameCapture.stop();
+
+    if (compareCapture) {
+        fprintf(stdout, "[INFO]: capture overhead %+.1f%%\n",
+                100.0 * (passMilliseconds[1] - passMilliseconds[0]) / passMilliseconds[0]);
+    }
+}
+
 ///*************************************************************************************
 //
 // Our main function
 
 //
-//	int main()
+//	int main( int argc, char *argv[] )
+//
+//      --benchmark <frames>       render that many frames in a hidden window and exit
+//      --capture <directory>      record every frame (in a benchmark, compare against not recording)
+//      --capture-format raw|ppm   a single raw RGBA stream (default) or a PPM image sequence
+//      --lights <count>|sweep     number of point lights, or benchmark 1, 64 and 1024 in turn
+//      --check-allocations        fail if any steady-state frame allocates on the heap (debug builds)
+//      --particles fill           respawn every dead particle at once, keeping the whole pool live
+//      --trees sweep              benchmark the packed, full and per-cube tree paths in turn
 //
-int main() {
+int main(int argc, char *argv[]) {
+    auto launchTime = std::chrono::steady_clock::now();
+
+    int benchmarkFrames = 0;
+    bool lightSweep = false;
+    bool treeSweep = false;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        if (argument == "--benchmark" && i + 1 < argc) {
+            benchmarkFrames = atoi(argv[++i]);
+        } else if (argument == "--capture" && i + 1 < argc) {
+            captureDirectory = argv[++i];
+            captureRequested = true;
+        } else if (argument == "--capture-format" && i + 1 < argc) {
+            captureFormat = std::string(argv[++i]) == "ppm" ? FrameCapture::PPM_SEQUENCE : FrameCapture::RAW_RGBA;
+        } else if (argument == "--lights" && i + 1 < argc) {
+            std::string count = argv[++i];
+            lightSweep = count == "sweep";
+            if (!lightSweep) numPointLights = atoi(count.c_str());
+        } else if (argument == "--check-allocations") {
+            checkAllocations = true;
+        } else if (argument == "--trees" && i + 1 < argc) {
+            treeSweep = std::string(argv[++i]) == "sweep";
+        } else if (argument == "--particles" && i + 1 < argc) {
+            fillParticles = std::string(argv[++i]) == "fill";
+        } else {
+            fprintf(stderr, "[ERROR]: Unknown argument \"%s\"\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // GLFW sets up our OpenGL context so must be done first
-    GLFWwindow *window = setupGLFW();                    // initialize all of the GLFW specific information related to OpenGL and our window
+    GLFWwindow *window = setupGLFW(benchmarkFrames == 0);                    // initialize all of the GLFW specific information related to OpenGL and our window
     setupOpenGL();                                        // initialize all of the OpenGL specific information
     CSCI441::OpenGLUtils::printOpenGLInfo();
     CSCI441::SimpleShader3::enableSmoothShading();
@@ -752,54 +1600,28 @@ int main() {
     printf("Controls:\n");
     printf("\tW / S - Move forwards / backwards\n");
     printf("\tMouse Drag - Pan camera\n");
+    printf("\tB - Cycle packed / full precision / per-cube trees\n");
+    printf("\tV - Cycle 1 / 2 / 4 split screen views\n");
+    printf("\tL - Cycle 1 / 64 / 1024 point lights\n");
+    printf("\tR - Start / stop recording to %s/\n", captureDirectory.c_str());
     printf("\tQ / ESC - Quit program\n");
 
+    if (benchmarkFrames > 0) {
+        if (lightSweep) {
+            runLightBenchmark(window, benchmarkFrames, launchTime);
+        } else if (treeSweep) {
+            runTreeBenchmark(window, benchmarkFrames, launchTime);
+        } else {
+            runBenchmark(window, benchmarkFrames, launchTime);
+        }
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
+
     //  This is our draw loop - all rendering is done here.  We use a loop to keep the window open
     //	until the user decides to close the window and quit the program.  Without a loop, the
     //	window will display once and then the program exits.
     while (!glfwWindowShouldClose(window)) {            // check if the window was instructed to be closed
-        glDrawBuffer(GL_BACK);                        // work with our back frame buffer
-        glClear(GL_COLOR_BUFFER_BIT |
-                GL_DEPTH_BUFFER_BIT);    // clear the current color contents and depth buffer in the window
-
-        // Get the size of our framebuffer.  Ideally this should be the same dimensions as our window, but
-        // when using a Retina display the actual window can be larger than the requested window.  Therefore
-        // query what the actual size of the window we are rendering to is.
-        GLint framebufferWidth, framebufferHeight;
-        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
-
-        // update the viewport - tell OpenGL we want to render to the whole window
-        glViewport(0, 0, framebufferWidth, framebufferHeight);
-
-        // update the projection matrix based on the window size
-        // the GL_PROJECTION matrix governs properties of the view coordinates;
-        // i.e. what gets seen - use a perspective projection that ranges
-        // with a FOV of 45 degrees, for our current aspect ratio, and Z ranges from [0.001, 1000].
-        glm::mat4 projMtx = glm::perspective(45.0f, (GLfloat) WINDOW_WIDTH / (GLfloat) WINDOW_HEIGHT, 0.001f, 1000.0f);
-        CSCI441::SimpleShader3::setProjectionMatrix(projMtx);
-
-
-        glm::mat4 viewMtx = glm::lookAt(glm::vec3(NotEvanVaughanXLocation, 8, NotEvanVaughanYLocation),
-                                        camDir + glm::vec3(NotEvanVaughanXLocation, 0, NotEvanVaughanYLocation),
-                                        glm::vec3(0, 1, 0));
-
-        if (arcBall) {
-            viewMtx = glm::lookAt((camDir + glm::vec3(NotEvanVaughanXLocation, 0, NotEvanVaughanYLocation)),
-                                            glm::vec3(NotEvanVaughanXLocation, 0, NotEvanVaughanYLocation),
-                                            glm::vec3(0, 1, 0));
-
-        } else if (freeCam) {
-            viewMtx = glm::lookAt( glm::vec3(camPos.x, camPos.y, camPos.z),
-                                             camPos + camDir,
-                                             glm::vec3(  0,  1,  0 ) );
-        }
-
-        // multiply by the look at matrix - this is the same as our view matrix
-        CSCI441::SimpleShader3::setViewMatrix(viewMtx);
-
-        bodyMotion += 0.05f;
-
-        renderScene();                                    // draw everything to the window
+        drawFrame(window, launchTime);
 
         glfwSwapBuffers(window);                        // flush the OpenGL commands and make sure they get rendered!
         glfwPollEvents();                                // check for any events and signal to redraw screen
@@ -817,8 +1639,28 @@ int main() {
         }
     }
 
+    frameCapture.stop();
+    textureLoader.shutdown();
+    meshLoader.shutdown();
+    particles.shutdown();
+    for (GpuTimer &timer : treeTimers) timer.shutdown();
+    shadowTimer.shutdown();
+
     glfwDestroyWindow(window);// clean up and close our window
     glfwTerminate();                        // shut down GLFW to clean up our context
 
+    if (checkAllocations) {
+        if (!AllocationCounter::ENABLED) {
+            fprintf(stderr, "[ERROR]: --check-allocations needs a debug build\n");
+            return EXIT_FAILURE;
+        }
+        if (allocatingFrames > 0) {
+            fprintf(stderr, "[ERROR]: %d steady-state frames allocated on the heap\n", allocatingFrames);
+            return EXIT_FAILURE;
+        }
+        fprintf(stdout, "[INFO]: no steady-state frame allocated; frame arena peaked at %zu of %zu KB\n",
+                frameArena().highWater() / 1024, frameArena().capacity() / 1024);
+    }
+
     return EXIT_SUCCESS;                // exit our program successfully!
 }